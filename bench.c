@@ -0,0 +1,64 @@
+/* Measurement of code regions for the benchmark commands */
+
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bench.h"
+#include "dudect/cpucycles.h"
+#include "report.h"
+
+/* Open a counter of hardware cache misses for the calling thread.
+ * Return -1 when the platform or its configuration does not allow it.
+ */
+static int cache_counter_open()
+{
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+void bench_start(bench_t *b)
+{
+    b->fd = cache_counter_open();
+#if defined(__linux__)
+    if (b->fd >= 0) {
+        ioctl(b->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(b->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    init_time(&b->start_time);
+    b->start_cycles = cpucycles();
+}
+
+void bench_stop(bench_t *b)
+{
+    b->cycles = cpucycles() - b->start_cycles;
+    b->seconds = delta_time(&b->start_time);
+    b->cache_misses = -1;
+#if defined(__linux__)
+    if (b->fd >= 0) {
+        long long count;
+        ioctl(b->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(b->fd, &count, sizeof(count)) == sizeof(count))
+            b->cache_misses = count;
+        close(b->fd);
+    }
+#endif
+    b->fd = -1;
+}
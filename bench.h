@@ -0,0 +1,25 @@
+#ifndef LAB0_BENCH_H
+#define LAB0_BENCH_H
+
+/* Measurement of code regions for the benchmark commands */
+
+#include <stdint.h>
+
+typedef struct {
+    double seconds;       /* Wall-clock time */
+    int64_t cycles;       /* CPU cycles as counted by cpucycles() */
+    int64_t cache_misses; /* Hardware cache misses, -1 if unavailable */
+
+    /* Private state of a running measurement */
+    double start_time;
+    int64_t start_cycles;
+    int fd;
+} bench_t;
+
+/* Start measuring */
+void bench_start(bench_t *b);
+
+/* Stop measuring and fill in the results */
+void bench_stop(bench_t *b);
+
+#endif /* LAB0_BENCH_H */
@@ -4,15 +4,20 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "dudect/cpucycles.h"
+#include "profile.h"
 #include "report.h"
+#include "trace.h"
 #include "web.h"
 
 /* Some global values */
@@ -20,6 +25,15 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Commands and parameters are looked up by name in open-addressing hash
+ * tables with linear probing. The sorted lists only serve help and
+ * completion.
+ */
+#define NAME_SLOTS 256
+static cmd_element_t *cmd_table[NAME_SLOTS];
+static param_element_t *param_table[NAME_SLOTS];
+static int n_cmds = 0, n_params = 0;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -31,6 +45,9 @@ static double first_time, last_time;
 
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped into memory instead, and lines are handed to the
+ * interpreter straight out of the mapping.  Mapped files that hold a binary
+ * trace are replayed record by record.
  */
 
 #define RIO_BUFSIZE 8192
@@ -40,6 +57,11 @@ typedef struct __rio {
     int count;             /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Whole file, if mapped into memory */
+    size_t maplen;         /* Length of mapping */
+    size_t mapoff;         /* Offset of next unread byte in mapping */
+    bool binary;           /* Whether the mapping holds a binary trace */
+    trace_reader_t trace;  /* Reader for binary trace */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
 
@@ -53,6 +75,10 @@ static int fd_max = 0;
 static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
+static int profiling = 0;
+
+/* File the profile was last saved to, written again at quit */
+static char *profile_file = NULL;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
@@ -65,6 +91,12 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Optional function to call around every command */
+static cmd_hook_t cmd_hook = NULL;
+
+/* Binary trace that commands read from input are recorded in, if any */
+static trace_writer_t *recorder = NULL;
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -72,6 +104,33 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of name, reduced to a slot of the name tables */
+static inline size_t name_slot(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h & (NAME_SLOTS - 1);
+}
+
+/* Slot holding the command called name, or the empty slot it would go in */
+static cmd_element_t **cmd_slot(const char *name)
+{
+    size_t i = name_slot(name);
+    while (cmd_table[i] && strcmp(cmd_table[i]->name, name) != 0)
+        i = (i + 1) & (NAME_SLOTS - 1);
+    return &cmd_table[i];
+}
+
+/* Slot holding the parameter called name, or the empty slot it would go in */
+static param_element_t **param_slot(const char *name)
+{
+    size_t i = name_slot(name);
+    while (param_table[i] && strcmp(param_table[i]->name, name) != 0)
+        i = (i + 1) & (NAME_SLOTS - 1);
+    return &param_table[i];
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -82,6 +141,11 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
         next_cmd = next_cmd->next;
     }
 
+    /* Keep a slot free so that probing for unknown names terminates */
+    cmd_element_t **slot = cmd_slot(name);
+    if (!*slot && ++n_cmds >= NAME_SLOTS)
+        report_event(MSG_FATAL, "Exceeded limit on commands");
+
     cmd_element_t *cmd = malloc_or_fail(sizeof(cmd_element_t), "add_cmd");
     cmd->name = name;
     cmd->operation = operation;
@@ -89,6 +153,7 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->param = param;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    *slot = cmd;
 }
 
 /* Add a new parameter */
@@ -101,34 +166,90 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
         next_param = next_param->next;
     }
 
+    param_element_t **slot = param_slot(name);
+    if (!*slot && ++n_params >= NAME_SLOTS)
+        report_event(MSG_FATAL, "Exceeded limit on parameters");
+
     param_element_t *param =
         malloc_or_fail(sizeof(param_element_t), "add_param");
     param->name = name;
     param->valp = valp;
     param->summary = summary;
+    param->names = NULL;
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    *slot = param;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Add a new parameter whose values can also be set by name */
+void add_enum_param(char *name,
+                    int *valp,
+                    char *const names[],
+                    char *summary,
+                    setter_func_t setter)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
+    add_param(name, valp, summary, setter);
+    (*param_slot(name))->names = names;
+}
 
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+/* Count the values of a parameter with named values */
+static int param_name_count(param_element_t *param)
+{
+    int n = 0;
+    while (param->names[n])
+        n++;
+    return n;
+}
 
-    char *src = line;
+/* Convert text to the value of a parameter, accepting value names */
+static bool get_param_value(param_element_t *param, char *vname, int *loc)
+{
+    if (get_int(vname, loc))
+        return true;
+    if (!param->names)
+        return false;
+    for (int i = 0; param->names[i]; i++) {
+        if (strcmp(param->names[i], vname) == 0) {
+            *loc = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Display one parameter with its current value */
+static void show_param(param_element_t *param)
+{
+    int val = *param->valp;
+    if (param->names && val >= 0 && val < param_name_count(param))
+        report(1, "  %-12s%-12s | %s", param->name, param->names[val],
+               param->summary);
+    else
+        report(1, "  %-12s%-12d | %s", param->name, val, param->summary);
+}
+
+/* Most command lines are split into storage on the stack.  Only longer
+ * lines, or lines with more words, need heap storage.
+ */
+#define MAX_ARGS 64
+
+/* Copy the first len bytes of line into buf with each word null-terminated,
+ * and point argv at the first maxargs words.  buf must hold len + 1 bytes.
+ * Return the number of words, which may exceed maxargs.
+ */
+static int split_args(const char *line,
+                      size_t len,
+                      char *buf,
+                      char **argv,
+                      int maxargs)
+{
+    const char *end = line + len;
     char *dst = buf;
     bool skipping = true;
     int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    while (line < end && (c = *line++) != '\0') {
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -138,24 +259,16 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
+                if (argc < maxargs)
+                    argv[argc] = dst;
                 argc++;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
-
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+    *dst = '\0';
+    return argc;
 }
 
 static void record_error()
@@ -173,12 +286,24 @@ static bool interpret_cmda(int argc, char *argv[])
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
+    cmd_element_t *next_cmd = *cmd_slot(argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        /* Command quit frees next_cmd, but not its name */
+        const char *name = next_cmd->name;
+        /* Commands may turn profiling on or off, and only those that ran
+         * with it on throughout are recorded.  That leaves out quit, which
+         * turns it off once the table is gone.
+         */
+        bool timed = profiling;
+        if (cmd_hook)
+            cmd_hook(name, false);
+        int64_t start = timed ? cpucycles() : 0;
         ok = next_cmd->operation(argc, argv);
+        if (timed && profiling)
+            profile_record(name, cpucycles() - start);
+        if (cmd_hook)
+            cmd_hook(name, true);
         if (!ok)
             record_error();
     } else {
@@ -190,22 +315,73 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Stop recording commands.  Return false if the trace could not be written
+ */
+static bool stop_recording()
+{
+    bool ok = trace_writer_close(recorder);
+    recorder = NULL;
+    if (!ok)
+        report(1, "Error writing trace file");
+    return ok;
+}
+
+/* Whether a command is left out of recorded traces.  The commands that
+ * source reads are recorded as they run instead.
+ */
+static bool unrecorded(const char *name)
+{
+    return strcmp(name, "trace") == 0 || strcmp(name, "source") == 0;
+}
+
+/* Execute a command read from input, recording it first if asked to */
+static bool dispatch(int argc, char *argv[])
+{
+    if (recorder && argc > 0 && !unrecorded(argv[0]) &&
+        !trace_write(recorder, argc, argv))
+        stop_recording();
+    return interpret_cmda(argc, argv);
+}
+
+/* Execute a command from the first len bytes of line, which need not be
+ * null-terminated
+ */
+static bool interpret_line(const char *line, size_t len)
 {
     if (quit_flag)
         return false;
 
-    int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    /* The line itself is left alone, since callers such as the line
+     * editor still use it afterwards
+     */
+    char line_buf[RIO_BUFSIZE];
+    char *arg_buf[MAX_ARGS];
+    char *buf = line_buf;
+    char **argv = arg_buf;
+    if (len >= sizeof(line_buf))
+        buf = malloc_or_fail(len + 1, "interpret_line");
+    int argc = split_args(line, len, buf, argv, MAX_ARGS);
+    if (argc > MAX_ARGS) {
+        argv = calloc_or_fail(argc, sizeof(char *), "interpret_line");
+        split_args(line, len, buf, argv, argc);
+    }
+
+    bool ok = dispatch(argc, argv);
+
+    if (argv != arg_buf)
+        free_array(argv, argc, sizeof(char *));
+    if (buf != line_buf)
+        free_block(buf, len + 1);
 
     return ok;
 }
 
+/* Execute a command from a null-terminated command line */
+static bool interpret_cmd(char *cmdline)
+{
+    return interpret_line(cmdline, strlen(cmdline));
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -215,6 +391,11 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+void set_cmd_hook(cmd_hook_t hook)
+{
+    cmd_hook = hook;
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -238,9 +419,28 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    n_cmds = n_params = 0;
 
     while (buf_stack)
         pop_file();
+    if (recorder)
+        ok = stop_recording() && ok;
+    if (profiling) {
+        profile_show();
+        if (profile_file && !profile_save(profile_file)) {
+            report(1, "Couldn't write profile to '%s'", profile_file);
+            ok = false;
+        }
+        /* So that quit itself is not recorded in the freed table */
+        profiling = 0;
+    }
+    if (profile_file) {
+        free_string(profile_file);
+        profile_file = NULL;
+    }
+    profile_reset();
 
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
@@ -262,8 +462,7 @@ static bool do_help(int argc, char *argv[])
     param_element_t *plist = param_list;
     report(1, "Options:");
     while (plist) {
-        report(1, "  %-12s%-12d | %s", plist->name, *plist->valp,
-               plist->summary);
+        show_param(plist);
         plist = plist->next;
     }
     return true;
@@ -301,8 +500,7 @@ static bool do_option(int argc, char *argv[])
         param_element_t *plist = param_list;
         report(1, "Options:");
         while (plist) {
-            report(1, "  %-12s%-12d | %s", plist->name, *plist->valp,
-                   plist->summary);
+            show_param(plist);
             plist = plist->next;
         }
         return true;
@@ -316,21 +514,24 @@ static bool do_option(int argc, char *argv[])
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
             return false;
-        } else if (!get_int(argv[++i], &value)) {
-            report(1, "Cannot parse '%s' as integer", argv[i]);
-            return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        i++;
+        /* Find parameter in table */
+        param_element_t *plist = *param_slot(name);
+        if (plist) {
+            if (!get_param_value(plist, argv[i], &value)) {
+                if (plist->names)
+                    report(1, "Unknown value '%s' for parameter %s", argv[i],
+                           name);
+                else
+                    report(1, "Cannot parse '%s' as integer", argv[i]);
+                return false;
+            }
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -391,6 +592,33 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static bool do_profile(int argc, char *argv[])
+{
+    if (argc == 1) {
+        profile_show();
+        return true;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "reset") == 0) {
+        profile_reset();
+        return true;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "save") == 0) {
+        if (!profile_save(argv[2])) {
+            report(1, "Couldn't write profile to '%s'", argv[2]);
+            return false;
+        }
+        if (profile_file)
+            free_string(profile_file);
+        profile_file = strsave_or_fail(argv[2], "do_profile");
+        return true;
+    }
+
+    report(1, "Usage: profile [reset | save file]");
+    return false;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -413,11 +641,88 @@ static bool do_web(int argc, char *argv[])
     return true;
 }
 
+/* Convert the text script in into binary trace out */
+static bool compile_trace(char *in, char *out)
+{
+    FILE *f = fopen(in, "r");
+    if (!f) {
+        report(1, "Could not open source file '%s'", in);
+        return false;
+    }
+    trace_writer_t *w = trace_writer_open(out);
+    if (!w) {
+        fclose(f);
+        report(1, "Couldn't open trace file '%s'", out);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    char **argv = NULL;
+    size_t max_args = 0;
+    bool ok = true;
+    while (ok && (len = getline(&line, &size, f)) >= 0) {
+        /* A line of len bytes has at most len / 2 + 1 words, and is split
+         * in place
+         */
+        if (len / 2 + 1 > max_args) {
+            if (argv)
+                free_array(argv, max_args, sizeof(char *));
+            max_args = len / 2 + 1;
+            argv = calloc_or_fail(max_args, sizeof(char *), "compile_trace");
+        }
+        int argc = split_args(line, len, line, argv, (int) max_args);
+        if (argc > 0)
+            ok = trace_write(w, argc, argv);
+    }
+
+    if (argv)
+        free_array(argv, max_args, sizeof(char *));
+    free(line);
+    fclose(f);
+    ok = trace_writer_close(w) && ok;
+    if (!ok)
+        report(1, "Error writing trace file '%s'", out);
+    return ok;
+}
+
+static bool do_trace(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "compile") == 0)
+        return compile_trace(argv[2], argv[3]);
+
+    if (argc == 3 && strcmp(argv[1], "record") == 0) {
+        if (recorder && !stop_recording())
+            return false;
+        recorder = trace_writer_open(argv[2]);
+        if (!recorder) {
+            report(1, "Couldn't open trace file '%s'", argv[2]);
+            return false;
+        }
+        return true;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "stop") == 0) {
+        if (!recorder) {
+            report(1, "Not recording a trace");
+            return false;
+        }
+        return stop_recording();
+    }
+
+    report(1, "Usage: trace compile in out | trace record file | trace stop");
+    return false;
+}
+
 /* Initialize interpreter */
 void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    memset(param_table, 0, sizeof(param_table));
+    n_cmds = n_params = 0;
     err_cnt = 0;
     quit_flag = false;
 
@@ -430,12 +735,20 @@ void init_cmd()
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
+    ADD_COMMAND(profile,
+                "Show or reset command latencies, or save them as CSV, or "
+                "JSON if file ends in .json, now and again at quit",
+                "[reset | save file]");
+    ADD_COMMAND(trace, "Compile, record or stop recording binary trace",
+                "compile in out | record file | stop");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("profile", &profiling,
+              "Record latency of every command (see 'profile')", NULL);
 
     init_in();
     init_time(&last_time);
@@ -460,6 +773,24 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->maplen = rnew->mapoff = 0;
+    struct stat st;
+    if (fd != STDIN_FILENO && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        /* Commands may write to their arguments, which point into the
+         * mapping for binary traces
+         */
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            rnew->map = map;
+            rnew->maplen = st.st_size;
+        }
+    }
+    rnew->binary =
+        rnew->map && trace_reader_init(&rnew->trace, rnew->map, rnew->maplen);
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -472,6 +803,10 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->binary)
+            trace_reader_destroy(&rsave->trace);
+        if (rsave->map)
+            munmap(rsave->map, rsave->maplen);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -483,60 +818,144 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
+/* Take the next line from a mapped file, without its newline.  The line is
+ * left in the mapping, which stays until the file is popped on the
+ * following call.
  */
-static char *readline()
+static char *map_line(rio_t *rio, size_t *lenp)
 {
-    char c;
-    char *lptr = linebuf;
-
-    if (!buf_stack)
+    if (rio->mapoff >= rio->maplen)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
+    char *line = rio->map + rio->mapoff;
+    size_t rest = rio->maplen - rio->mapoff;
+    char *nl = memchr(line, '\n', rest);
+    size_t len = nl ? (size_t) (nl - line) : rest;
+    rio->mapoff += nl ? len + 1 : len;
+    *lenp = len;
+    return line;
+}
+
+/* Copy the next line from a file read through the internal buffer into
+ * linebuf, without its newline.  A line that does not fit in linebuf is
+ * artificially split.
+ */
+static char *buffer_line(rio_t *rio, size_t *lenp)
+{
+    size_t len = 0;
+    bool partial = false;
+
+    while (len < RIO_BUFSIZE - 2) {
+        if (rio->count <= 0) {
             /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
-                /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
+            rio->count = read(rio->fd, rio->buf, RIO_BUFSIZE);
+            rio->bufptr = rio->buf;
+            if (rio->count <= 0) {
+                /* Encountered EOF.  Return any unterminated last line */
+                if (!partial)
+                    return NULL;
+                break;
             }
         }
 
         /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
+        size_t avail = rio->count;
+        if (avail > RIO_BUFSIZE - 2 - len)
+            avail = RIO_BUFSIZE - 2 - len;
+        char *nl = memchr(rio->bufptr, '\n', avail);
+        size_t n = nl ? (size_t) (nl - rio->bufptr) : avail;
+        memcpy(linebuf + len, rio->bufptr, n);
+        len += n;
+        partial = true;
+        if (nl)
+            n++;
+        rio->bufptr += n;
+        rio->count -= n;
+        if (nl)
             break;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    linebuf[len] = '\0';
+    *lenp = len;
+    return linebuf;
+}
+
+/* Read command from input file, and set *lenp to its length.
+ * The line need not be null-terminated, and is only valid until the next
+ * call.  When hit EOF, close that file and return NULL
+ */
+static char *readline(size_t *lenp)
+{
+    if (!buf_stack)
+        return NULL;
+
+    char *line = buf_stack->map ? map_line(buf_stack, lenp)
+                                : buffer_line(buf_stack, lenp);
+    if (!line) {
+        pop_file();
+        return NULL;
+    }
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%.*s\n", (int) *lenp, line);
     }
-    *lptr++ = '\0';
+
+    return line;
+}
+
+/* Whether input is already waiting in the current file's buffer */
+static bool input_pending()
+{
+    if (!buf_stack)
+        return false;
+    if (buf_stack->binary)
+        return trace_pending(&buf_stack->trace);
+    if (buf_stack->map)
+        return buf_stack->mapoff < buf_stack->maplen;
+    return buf_stack->count > 0;
+}
+
+/* Execute the next record of the binary trace being read.
+ * When hit the end, close that file
+ */
+static void replay_record()
+{
+    char **argv;
+    int argc = trace_next(&buf_stack->trace, &argv);
+    if (argc < 0) {
+        if (argc == TRACE_BAD) {
+            report(1, "Corrupt trace file");
+            record_error();
+        }
+        pop_file();
+        return;
+    }
+    if (quit_flag)
+        return;
 
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        for (int i = 0; i < argc; i++)
+            report_noreturn(1, "%s%s", argv[i], i + 1 < argc ? " " : "");
+        report_noreturn(1, "\n");
+    }
+    dispatch(argc, argv);
+}
+
+/* Execute the next command from the current input file */
+static void run_input()
+{
+    set_echo(0);
+    if (buf_stack->binary) {
+        replay_record();
+        return;
     }
 
-    return linebuf;
+    size_t len;
+    char *cmdline = readline(&len);
+    if (cmdline)
+        interpret_line(cmdline, len);
 }
 
 static bool cmd_done()
@@ -566,6 +985,14 @@ static int cmd_select(int nfds,
     if (cmd_done())
         return 0;
 
+    /* Buffered input needs no select, unless the caller also waits on
+     * other descriptors or the web server could starve
+     */
+    if (!block_flag && nfds == 0 && web_fd <= 0 && input_pending()) {
+        run_input();
+        return 0;
+    }
+
     if (!block_flag) {
         /* Process any commands in input buffer */
         if (!readfds)
@@ -604,10 +1031,7 @@ static int cmd_select(int nfds,
         FD_CLR(infd, readfds);
         result--;
 
-        set_echo(0);
-        char *cmdline = readline();
-        if (cmdline)
-            interpret_cmd(cmdline);
+        run_input();
     } else if (readfds && FD_ISSET(web_fd, readfds)) {
         FD_CLR(web_fd, readfds);
         result--;
@@ -35,6 +35,8 @@ typedef struct __param_element {
     char *name;
     int *valp;
     char *summary;
+    /* Optional NULL-terminated names of values 0, 1, ... */
+    char *const *names;
     /* Function that gets called whenever parameter changes */
     setter_func_t setter;
     struct __param_element *next;
@@ -50,9 +52,26 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *parameter);
 /* Add a new parameter */
 void add_param(char *name, int *valp, char *summary, setter_func_t setter);
 
+/* Add a new parameter whose values 0, 1, ... can also be set by name.
+ * names is a NULL-terminated array.
+ */
+void add_enum_param(char *name,
+                    int *valp,
+                    char *const names[],
+                    char *summary,
+                    setter_func_t setter);
+
 /* Extract integer from text and store at loc */
 bool get_int(char *vname, int *loc);
 
+/* Function called with done false right before and with done true right
+ * after every command. name is the name the command was added with.
+ */
+typedef void (*cmd_hook_t)(const char *name, bool done);
+
+/* Install hook around commands, NULL for none */
+void set_cmd_hook(cmd_hook_t hook);
+
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
@@ -0,0 +1,137 @@
+/* Growable circular array of pointers */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deque.h"
+#include "harness.h"
+
+/* Slots allocated for the first item */
+#define DEQUE_MIN_SLOTS 16
+
+void deque_init(deque_t *d)
+{
+    memset(d, 0, sizeof(deque_t));
+}
+
+void deque_destroy(deque_t *d)
+{
+    free(d->slots);
+    deque_init(d);
+}
+
+bool deque_reserve(deque_t *d, size_t n)
+{
+    size_t cap = deque_capacity(d);
+    if (d->count + n <= cap)
+        return true;
+
+    size_t new_cap = cap ? cap : DEQUE_MIN_SLOTS;
+    while (new_cap < d->count + n)
+        new_cap <<= 1;
+    void **slots = malloc(new_cap * sizeof(void *));
+    if (!slots)
+        return false;
+    for (size_t i = 0; i < d->count; i++)
+        slots[i] = *deque_at(d, i);
+    free(d->slots);
+    d->slots = slots;
+    d->mask = new_cap - 1;
+    d->first = 0;
+    return true;
+}
+
+bool deque_push_head(deque_t *d, void *p)
+{
+    if (!deque_reserve(d, 1))
+        return false;
+    d->first = (d->first - 1) & d->mask;
+    d->slots[d->first] = p;
+    d->count++;
+    return true;
+}
+
+bool deque_push_tail(deque_t *d, void *p)
+{
+    if (!deque_reserve(d, 1))
+        return false;
+    *deque_at(d, d->count++) = p;
+    return true;
+}
+
+void *deque_pop_head(deque_t *d)
+{
+    if (!d->count)
+        return NULL;
+    void *p = d->slots[d->first];
+    d->first = (d->first + 1) & d->mask;
+    d->count--;
+    return p;
+}
+
+void *deque_pop_tail(deque_t *d)
+{
+    if (!d->count)
+        return NULL;
+    return *deque_at(d, --d->count);
+}
+
+void *deque_erase(deque_t *d, size_t i)
+{
+    void *p = *deque_at(d, i);
+    if (i < d->count / 2) {
+        for (size_t j = i; j > 0; j--)
+            *deque_at(d, j) = *deque_at(d, j - 1);
+        d->first = (d->first + 1) & d->mask;
+    } else {
+        for (size_t j = i; j + 1 < d->count; j++)
+            *deque_at(d, j) = *deque_at(d, j + 1);
+    }
+    d->count--;
+    return p;
+}
+
+void deque_drop_head(deque_t *d, size_t n)
+{
+    d->first = (d->first + n) & d->mask;
+    d->count -= n;
+}
+
+void deque_drop_tail(deque_t *d, size_t n)
+{
+    d->count -= n;
+}
+
+void deque_reverse(deque_t *d, size_t i, size_t n)
+{
+    for (size_t lo = i, hi = i + n; lo + 1 < hi; lo++, hi--) {
+        void **a = deque_at(d, lo), **b = deque_at(d, hi - 1);
+        void *tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+}
+
+/* Reverse the slots from lo up to but not including hi */
+static void reverse_slots(void **slots, size_t lo, size_t hi)
+{
+    for (; lo + 1 < hi; lo++, hi--) {
+        void *tmp = slots[lo];
+        slots[lo] = slots[hi - 1];
+        slots[hi - 1] = tmp;
+    }
+}
+
+void **deque_linearize(deque_t *d)
+{
+    size_t cap = d->mask + 1;
+    if (d->slots && d->first + d->count > cap) {
+        /* Rotating left by first takes three reversals and no storage */
+        reverse_slots(d->slots, 0, d->first);
+        reverse_slots(d->slots, d->first, cap);
+        reverse_slots(d->slots, 0, cap);
+        d->first = 0;
+    }
+    return d->slots + d->first;
+}
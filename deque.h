@@ -0,0 +1,65 @@
+#ifndef LAB0_DEQUE_H
+#define LAB0_DEQUE_H
+
+/* Growable circular array of pointers.
+ *
+ * Items live in a power-of-two sized array of slots that wraps around, so
+ * both ends take constant time and the i-th item is found by masking. The
+ * array doubles when full and is obtained through the harness allocator.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    void **slots;
+    size_t mask;  /* Number of slots minus one, 0 before the first item */
+    size_t first; /* Slot of the item at the head */
+    size_t count;
+} deque_t;
+
+/* Initialize an empty deque. No storage is allocated until needed. */
+void deque_init(deque_t *d);
+
+/* Free the slots. The items themselves are left to the caller. */
+void deque_destroy(deque_t *d);
+
+/* Number of items the slots hold without growing */
+static inline size_t deque_capacity(const deque_t *d)
+{
+    return d->slots ? d->mask + 1 : 0;
+}
+
+/* Make room for n more items.  Return false if allocation failed */
+bool deque_reserve(deque_t *d, size_t n);
+
+/* Address of the slot holding the i-th item from the head */
+static inline void **deque_at(const deque_t *d, size_t i)
+{
+    return &d->slots[(d->first + i) & d->mask];
+}
+
+/* Add p at either end.  Return false if allocation failed */
+bool deque_push_head(deque_t *d, void *p);
+bool deque_push_tail(deque_t *d, void *p);
+
+/* Remove the item at either end.  Return NULL if the deque is empty */
+void *deque_pop_head(deque_t *d);
+void *deque_pop_tail(deque_t *d);
+
+/* Remove the i-th item, moving the shorter side over the gap */
+void *deque_erase(deque_t *d, size_t i);
+
+/* Drop n items from the head or the tail without looking at them */
+void deque_drop_head(deque_t *d, size_t n);
+void deque_drop_tail(deque_t *d, size_t n);
+
+/* Reverse the order of the n items starting with the i-th one */
+void deque_reverse(deque_t *d, size_t i, size_t n);
+
+/* Rotate the items in place if they wrap around the end of the slots, and
+ * return the slot of the head item.  The items then form a plain array.
+ */
+void **deque_linearize(deque_t *d);
+
+#endif /* LAB0_DEQUE_H */
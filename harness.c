@@ -1,10 +1,15 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -18,6 +23,9 @@
 /* Value at start of every allocated block */
 #define MAGICHEADER 0xdeadbeef
 
+/* Value at start of every block placed against a guard page */
+#define MAGICGUARD 0xdeadbe11
+
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
@@ -27,31 +35,97 @@
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Bytes poisoned at either end of a payload in POISON_HEADER mode */
+#define POISON_LINE 64
+
+/* Smallest number of slots in the table of live blocks */
+#define MIN_LIVE_SLOTS 1024
+
+/* Number of call sites every thread keeps apart, later ones are lumped */
+#define SITE_SLOTS 64
+
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+typedef struct __tracker tracker_t;
+
+/* Header placed in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
+    tracker_t *owner;    /* Tracker of the allocating thread */
+    const char *site;    /* Call site of the allocation */
+    void *base;          /* Start of the memory holding the block */
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    unsigned char payload[0] __attribute__((aligned(16)));
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Every thread tracks the blocks it allocates in a tracker of its own, so
+ * threads allocating concurrently do not contend. A block freed by another
+ * thread is dropped from its owner's tracker under that tracker's lock.
+ *
+ * Allocated blocks are kept in an open-addressing hash table with linear
+ * probing, keyed by block address, so that checking whether a block is
+ * live takes constant time even for millions of blocks.
+ */
+struct __tracker {
+    pthread_mutex_t lock; /* Protects the fields below */
+    block_element_t **live_table;
+    size_t live_mask; /* Number of slots minus one */
+    size_t allocated_count;
+    size_t poisoned_bytes; /* Bytes filled with FILLCHAR */
+    size_t allocs, frees;
+    size_t guarded; /* Allocations placed against a guard page */
+    size_t live_bytes, peak_bytes; /* Payload bytes of blocks in the table */
+    size_t size_hist[ALLOC_HIST_BUCKETS];
+    alloc_site_t sites[SITE_SLOTS]; /* Open addressing by site address */
+    bool orphan;     /* Its thread has exited, guarded by registry_lock */
+    tracker_t *next; /* Next tracker in the registry */
+};
+
+/* Trackers are never freed. Those of exited threads keep their blocks and
+ * are handed to the next thread starting to allocate.
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static tracker_t *trackers = NULL;
+static pthread_key_t tracker_key;
+static pthread_once_t tracker_once = PTHREAD_ONCE_INIT;
+static __thread tracker_t *self = NULL;
+
+/* Parameters of the failure schedule */
+int fail_probability = 0; /* Percent probability of malloc failure */
+int fail_every = 0;       /* Fail every Nth allocation */
+int fail_after = 0;       /* Fail allocations beyond this many bytes */
+int fail_seed = 0;        /* Seed of the schedule, 0 for a random one */
+
+/* Whether any failure is scheduled at all, so that the common case costs a
+ * single test. Recomputed by the main thread whenever the parameters change,
+ * and read by every allocating thread.
+ */
+static atomic_bool fail_active = false;
+static atomic_bool fail_suspended = false;
+
+/* Progress of the calling thread through the failure schedule */
+static __thread uint64_t fail_rng; /* xorshift64 state, never 0 */
+static __thread unsigned long fail_calls;
+static __thread size_t fail_bytes;
+static __thread unsigned int thread_no; /* Order of first allocation */
+static atomic_uint threads_seen = 0;
+
+int poison_mode = POISON_FULL;
 
-/* Percent probability of malloc failure */
-int fail_probability = 0;
+/* Place one in guard_rate allocations against a guard page, 0 for none */
+int guard_rate = 0;
+static __thread uint64_t guard_rng;  /* xorshift64 state, never 0 */
+static __thread long guard_countdown; /* Allocations until the next guard */
 
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
+static __thread bool error_occurred = false;
+/* Errors left behind by threads that have exited */
+static atomic_bool exited_error = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+static int time_limit = 10;
 
 /* Data for managing exceptions */
 static jmp_buf env;
@@ -60,42 +134,322 @@ static bool time_limited = false;
 
 /* Internal functions */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+/* Home slot of block b in the table of live blocks.
+ * Consecutive allocations tend to be adjacent in memory, so dropping only the
+ * alignment bits keeps their slots adjacent as well and the table cache
+ * friendly.
+ */
+static inline size_t live_hash(const tracker_t *t, const block_element_t *b)
+{
+    return ((uintptr_t) b >> 4) & t->live_mask;
+}
+
+/* Return the slot of tracker t holding block b, or NULL if b is not live */
+static block_element_t **live_find(tracker_t *t, const block_element_t *b)
+{
+    if (!t->live_table)
+        return NULL;
+    for (size_t i = live_hash(t, b);; i = (i + 1) & t->live_mask) {
+        if (t->live_table[i] == b)
+            return &t->live_table[i];
+        if (!t->live_table[i])
+            return NULL;
+    }
+}
+
+/* Double the table of live blocks of tracker t and rehash its entries */
+static void live_grow(tracker_t *t)
+{
+    block_element_t **old_table = t->live_table;
+    size_t old_slots = old_table ? t->live_mask + 1 : 0;
+    size_t slots = old_slots ? old_slots << 1 : MIN_LIVE_SLOTS;
+
+    t->live_table = calloc(slots, sizeof(block_element_t *));
+    if (!t->live_table) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
+    t->live_mask = slots - 1;
+
+    for (size_t j = 0; j < old_slots; j++) {
+        if (!old_table[j])
+            continue;
+        size_t i = live_hash(t, old_table[j]);
+        while (t->live_table[i])
+            i = (i + 1) & t->live_mask;
+        t->live_table[i] = old_table[j];
+    }
+    free(old_table);
+}
+
+/* Record block b as live in tracker t */
+static void live_insert(tracker_t *t, block_element_t *b)
+{
+    /* Keep load factor at most one half */
+    if (!t->live_table || (t->allocated_count + 1) * 2 > t->live_mask + 1)
+        live_grow(t);
+    size_t i = live_hash(t, b);
+    while (t->live_table[i])
+        i = (i + 1) & t->live_mask;
+    t->live_table[i] = b;
+    t->allocated_count++;
+}
+
+/* Drop the block in slot from the table of live blocks of tracker t.
+ * Later entries of the same probe run are shifted back, so that lookups
+ * never need tombstones.
+ */
+static void live_remove(tracker_t *t, block_element_t **slot)
+{
+    size_t i = slot - t->live_table;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & t->live_mask;
+        if (!t->live_table[j])
+            break;
+        size_t k = live_hash(t, t->live_table[j]);
+        /* Entry j may fill the hole at i unless its home lies in (i, j] */
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            t->live_table[i] = t->live_table[j];
+            i = j;
+        }
+    }
+    t->live_table[i] = NULL;
+    t->allocated_count--;
+}
+
+/* Turn seed into a state for xorshift64(). The splitmix64 finalizer spreads
+ * small seeds over all bits.
+ */
+static uint64_t rng_state(uint64_t seed)
+{
+    seed ^= seed >> 30;
+    seed *= 0xbf58476d1ce4e5b9ULL;
+    seed ^= seed >> 27;
+    seed *= 0x94d049bb133111ebULL;
+    seed ^= seed >> 31;
+    return seed ? seed : 1;
+}
+
+/* Start the failure schedule of the calling thread from the beginning */
+static void start_fail_schedule()
+{
+    fail_calls = 0;
+    fail_bytes = 0;
+
+    /* A fixed seed gives every thread its own reproducible sequence */
+    uint64_t seed = fail_seed
+                        ? (uint64_t) fail_seed * 0x9e3779b97f4a7c15ULL +
+                              thread_no
+                        : (uint64_t) random() << 31 ^ random();
+    fail_rng = rng_state(seed);
+}
+
+/* Return the statistics of call site in tracker t. The last slot is kept
+ * for the sites that do not fit anymore.
+ */
+static alloc_site_t *site_stats(tracker_t *t, const char *site)
+{
+    size_t i = ((uintptr_t) site >> 3) % (SITE_SLOTS - 1);
+    for (int n = 0; n < SITE_SLOTS - 1; n++) {
+        alloc_site_t *s = &t->sites[i];
+        if (s->site == site)
+            return s;
+        if (!s->site) {
+            s->site = site;
+            return s;
+        }
+        i = (i + 1) % (SITE_SLOTS - 1);
+    }
+    t->sites[SITE_SLOTS - 1].site = "(other)";
+    return &t->sites[SITE_SLOTS - 1];
+}
+
+/* Index of the smallest power of two holding size bytes */
+static inline int size_bucket(size_t size)
+{
+    return size <= 1 ? 0 : 64 - __builtin_clzll(size - 1);
+}
+
+/* Called when a thread that has allocated exits */
+static void tracker_exit(void *arg)
+{
+    tracker_t *t = arg;
+    pthread_mutex_lock(&registry_lock);
+    t->orphan = true;
+    pthread_mutex_unlock(&registry_lock);
+    if (error_occurred)
+        atomic_store(&exited_error, true);
+}
+
+static void tracker_key_init()
+{
+    pthread_key_create(&tracker_key, tracker_exit);
+}
+
+/* Return the tracker of the calling thread, adopting an orphaned one or
+ * creating a new one on first use
+ */
+static tracker_t *tracker()
+{
+    if (self)
+        return self;
+
+    pthread_once(&tracker_once, tracker_key_init);
+    pthread_mutex_lock(&registry_lock);
+    tracker_t *t = trackers;
+    while (t && !t->orphan)
+        t = t->next;
+    if (t) {
+        t->orphan = false;
+    } else {
+        t = calloc(1, sizeof(tracker_t));
+        if (!t)
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        pthread_mutex_init(&t->lock, NULL);
+        t->next = trackers;
+        trackers = t;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(tracker_key, t);
+    thread_no = atomic_fetch_add(&threads_seen, 1);
+    self = t;
+    start_fail_schedule();
+    guard_rng = rng_state(thread_no);
+    return t;
+}
+
+static inline uint64_t xorshift64(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Should this allocation of size bytes fail? */
+static inline bool fail_allocation(size_t size)
+{
+    if (!atomic_load_explicit(&fail_active, memory_order_relaxed))
+        return false;
+
+    bool fail;
+    if (fail_every && ++fail_calls % fail_every == 0)
+        fail = true;
+    else if (fail_after && fail_bytes + size > (size_t) fail_after)
+        fail = true;
+    else
+        /* Compare the top 32 random bits against the percentage scaled
+         * to 2^32, which avoids both floating point and division
+         */
+        fail = (xorshift64(&fail_rng) >> 32) * 100 <
+               (uint64_t) fail_probability << 32;
+    if (!fail)
+        fail_bytes += size;
+    return fail;
+}
+
+/* Should this allocation go against a guard page? Gaps between guarded
+ * allocations are drawn uniformly from 1 to 2 * guard_rate - 1, so that
+ * allocations recurring in a fixed pattern are all sampled eventually.
+ */
+static inline bool guard_allocation()
+{
+    if (!guard_rate || --guard_countdown > 0)
+        return false;
+    guard_countdown =
+        1 + (long) (xorshift64(&guard_rng) % (2 * (uint64_t) guard_rate - 1));
+    return true;
+}
+
+/* Alignment of guarded payloads, as strict as that of any other payload
+ * and enough for any object
+ */
+#define GUARD_ALIGN                                    \
+    (_Alignof(max_align_t) > _Alignof(block_element_t) \
+         ? _Alignof(max_align_t)                       \
+         : _Alignof(block_element_t))
+
+/* Header of the block holding payload p */
+static inline block_element_t *header_of(void *p)
+{
+    return (block_element_t *) ((uintptr_t) p - sizeof(block_element_t));
+}
+
+/* Map fresh pages for a payload of size bytes that ends where a PROT_NONE
+ * page starts, so that running past the payload faults at once instead of
+ * being found by the footer check at free time. The payload is aligned down
+ * to align, at least GUARD_ALIGN, which leaves a gap of less than that many
+ * bytes before the guard page. Overruns into the gap go unnoticed. Store
+ * the start of the mapping at *basep. Return NULL if mapping failed.
+ */
+static void *guarded_payload(size_t size, size_t align, void **basep)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (align < GUARD_ALIGN)
+        align = GUARD_ALIGN;
+    size_t len =
+        (sizeof(block_element_t) + align - 1 + size + page - 1) & ~(page - 1);
+    unsigned char *base = mmap(NULL, len + page, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base + len, page, PROT_NONE) != 0) {
+        munmap(base, len + page);
+        return NULL;
+    }
+    *basep = base;
+    return (void *) ((uintptr_t) (base + len - size) & ~(align - 1));
+}
+
+/* Unmap the pages of guarded block b. Later accesses through stale pointers
+ * fault as well, until the pages are mapped again.
+ */
+static void unmap_guarded(block_element_t *b)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    /* The gap before the guard page is smaller than a page */
+    uintptr_t guard = ((uintptr_t) b->payload + b->payload_size + page - 1) &
+                      ~(page - 1);
+    munmap(b->base, guard + page - (uintptr_t) b->base);
 }
 
 /* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+ * Signal error if doesn't seem like legitimate block.
+ * Return with the lock of the owning tracker held and the slot of the block
+ * stored at *slotp, or with *ownerp set to NULL if the header is corrupted.
+ * *slotp is NULL if the block is not live.
  */
-static block_element_t *find_header(void *p)
+static block_element_t *find_header(void *p,
+                                    tracker_t **ownerp,
+                                    block_element_t ***slotp)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
         error_occurred = true;
     }
 
-    block_element_t *b =
-        (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
-        }
+    block_element_t *b = header_of(p);
+    /* An intact magic number vouches for the owner stored in front of it */
+    bool intact =
+        b->magic_header == MAGICHEADER || b->magic_header == MAGICGUARD;
+    *ownerp = intact ? b->owner : NULL;
+    *slotp = NULL;
+    if (*ownerp) {
+        pthread_mutex_lock(&(*ownerp)->lock);
+        *slotp = live_find(*ownerp, b);
+    }
+    /* The owner's table tells whether an intact block is really allocated,
+     * and only cautious mode bothers to say so for a corrupted one
+     */
+    if ((*ownerp || cautious_mode) && !*slotp) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (!intact) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
@@ -106,6 +460,32 @@ static block_element_t *find_header(void *p)
     return b;
 }
 
+/* Number of bytes of a payload of size bytes that poison() fills */
+static inline size_t poison_length(size_t size)
+{
+    if (poison_mode == POISON_OFF)
+        return 0;
+    if (poison_mode == POISON_HEADER && size > 2 * POISON_LINE)
+        return 2 * POISON_LINE;
+    return size;
+}
+
+/* Fill the size bytes of payload p with FILLCHAR as far as poison_mode asks
+ * for. Return the number of bytes filled.
+ */
+static size_t poison(void *p, size_t size)
+{
+    size_t n = poison_length(size);
+    if (n && n < size) {
+        memset(p, FILLCHAR, POISON_LINE);
+        memset((unsigned char *) p + size - POISON_LINE, FILLCHAR,
+               POISON_LINE);
+    } else {
+        memset(p, FILLCHAR, n);
+    }
+    return n;
+}
+
 /* Given pointer to block, find its footer */
 static size_t *find_footer(block_element_t *b)
 {
@@ -118,42 +498,95 @@ static size_t *find_footer(block_element_t *b)
 /* Implementation of application functions */
 
 void *test_malloc(size_t size)
+{
+    return test_malloc_at(size, "(unknown)");
+}
+
+/* Allocate a block with a payload of size bytes aligned to align, a power
+ * of two, or just to the alignment of block headers if align is smaller
+ */
+static void *alloc_block(size_t size, size_t align, const char *site)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to malloc disallowed");
         return NULL;
     }
 
-    if (fail_allocation()) {
+    tracker_t *t = tracker();
+    if (fail_allocation(size)) {
         report_event(MSG_WARN, "Malloc returning NULL");
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
+    /* Guarded blocks go without footer, their guard page takes its place */
+    void *base = NULL;
+    void *p = guard_allocation() ? guarded_payload(size, align, &base) : NULL;
+    bool guarded = p;
+    block_element_t *new_block;
+    if (guarded) {
+        new_block = header_of(p);
+        new_block->magic_header = MAGICGUARD;
+        new_block->payload_size = size;
+    } else {
+        /* Headers keep payloads aligned to their own alignment */
+        size_t slack = align > _Alignof(block_element_t)
+                           ? align - _Alignof(block_element_t)
+                           : 0;
+        size_t total = slack + size + sizeof(block_element_t) + sizeof(size_t);
+        /* malloc puts a size word in front of every chunk. Chunks spanning
+         * whole multiples of align keep payloads allocated back to back at
+         * a constant stride, which hardware prefetchers pick up on.
+         */
+        if (slack)
+            total = ((total + sizeof(size_t) + align - 1) & ~(align - 1)) -
+                    sizeof(size_t);
+        base = malloc(total);
+        if (!base) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+        }
+        new_block = base;
+        if (slack)
+            new_block = header_of((void *) (((uintptr_t) base +
+                                             sizeof(block_element_t) + slack) &
+                                            ~(uintptr_t) (align - 1)));
+
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->magic_header = MAGICHEADER;
+        // cppcheck-suppress nullPointerRedundantCheck
+        new_block->payload_size = size;
+        *find_footer(new_block) = MAGICFOOTER;
+        p = (void *) &new_block->payload;
     }
+    new_block->base = base;
+    new_block->owner = t;
+    new_block->site = site;
+    size_t poisoned = poison(p, size);
+    pthread_mutex_lock(&t->lock);
+    t->poisoned_bytes += poisoned;
+    t->allocs++;
+    t->guarded += guarded;
+    t->live_bytes += size;
+    if (t->live_bytes > t->peak_bytes)
+        t->peak_bytes = t->live_bytes;
+    t->size_hist[size_bucket(size)]++;
+    alloc_site_t *s = site_stats(t, site);
+    s->allocs++;
+    s->live_bytes += size;
+    live_insert(t, new_block);
+    pthread_mutex_unlock(&t->lock);
 
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
+    return p;
+}
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+void *test_malloc_at(size_t size, const char *site)
+{
+    return alloc_block(size, 0, site);
+}
 
-    return p;
+void *test_aligned_alloc_at(size_t align, size_t size, const char *site)
+{
+    return alloc_block(size, align, site);
 }
 
 // cppcheck-suppress unusedFunction
@@ -178,38 +611,63 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
-        report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
-        error_occurred = true;
+    tracker_t *owner;
+    block_element_t **slot;
+    block_element_t *b = find_header(p, &owner, &slot);
+    /* Corrupted, already freed or not ours to free. Where the block starts
+     * cannot be trusted, so it is left alone.
+     */
+    if (!slot) {
+        if (owner)
+            pthread_mutex_unlock(&owner->lock);
+        return;
+    }
+    /* Guarded pages are unmapped below, no need to poison them */
+    bool guarded = b->magic_header == MAGICGUARD;
+    size_t size = b->payload_size;
+    size_t poisoned = 0;
+    if (!guarded) {
+        size_t footer = *find_footer(b);
+        if (footer != MAGICFOOTER) {
+            report_event(MSG_ERROR,
+                         "Corruption detected in block with address %p when "
+                         "attempting to free it",
+                         p);
+            error_occurred = true;
+        }
+        *find_footer(b) = MAGICFREE;
+        /* Counted now, filled once the lock is dropped */
+        poisoned = poison_length(size);
     }
     b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
 
-    free(b);
-    allocated_count--;
+    alloc_site_t *s = site_stats(owner, b->site);
+    s->frees++;
+    s->live_bytes -= size;
+    owner->frees++;
+    owner->live_bytes -= size;
+    owner->poisoned_bytes += poisoned;
+    live_remove(owner, slot);
+    pthread_mutex_unlock(&owner->lock);
+
+    if (guarded) {
+        unmap_guarded(b);
+    } else {
+        poison(p, size);
+        free(b->base);
+    }
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
+{
+    return test_strdup_at(s, "(unknown)");
+}
+
+char *test_strdup_at(const char *s, const char *site)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = test_malloc_at(len, site);
     if (!new)
         return NULL;
 
@@ -218,11 +676,98 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (tracker_t *t = trackers; t; t = t->next) {
+        pthread_mutex_lock(&t->lock);
+        count += t->allocated_count;
+        pthread_mutex_unlock(&t->lock);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return count;
+}
+
+/* Add the statistics of tracker t to stats */
+static void merge_stats(alloc_stats_t *stats, tracker_t *t)
+{
+    stats->allocs += t->allocs;
+    stats->frees += t->frees;
+    stats->guarded += t->guarded;
+    stats->live_blocks += t->allocated_count;
+    stats->live_bytes += t->live_bytes;
+    stats->thread_peaks += t->peak_bytes;
+    stats->poisoned_bytes += t->poisoned_bytes;
+    for (int i = 0; i < ALLOC_HIST_BUCKETS; i++)
+        stats->size_hist[i] += t->size_hist[i];
+
+    for (int i = 0; i < SITE_SLOTS; i++) {
+        const alloc_site_t *from = &t->sites[i];
+        if (!from->site)
+            continue;
+        int j = 0;
+        while (j < stats->n_sites && stats->sites[j].site != from->site)
+            j++;
+        if (j == stats->n_sites) {
+            if (j == ALLOC_MAX_SITES)
+                continue;
+            stats->sites[stats->n_sites++].site = from->site;
+        }
+        stats->sites[j].allocs += from->allocs;
+        stats->sites[j].frees += from->frees;
+        stats->sites[j].live_bytes += from->live_bytes;
+    }
+}
+
+void alloc_stats(alloc_stats_t *stats)
+{
+    memset(stats, 0, sizeof(alloc_stats_t));
+    stats->overhead = sizeof(block_element_t) + sizeof(size_t);
+    pthread_mutex_lock(&registry_lock);
+    for (tracker_t *t = trackers; t; t = t->next) {
+        pthread_mutex_lock(&t->lock);
+        merge_stats(stats, t);
+        pthread_mutex_unlock(&t->lock);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void alloc_totals(size_t *allocs, size_t *frees)
+{
+    *allocs = *frees = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (tracker_t *t = trackers; t; t = t->next) {
+        pthread_mutex_lock(&t->lock);
+        *allocs += t->allocs;
+        *frees += t->frees;
+        pthread_mutex_unlock(&t->lock);
+    }
+    pthread_mutex_unlock(&registry_lock);
 }
 
 /* Implementation of functions for testing */
 
+/* Restart the failure schedule of the calling thread */
+void reset_fail_schedule()
+{
+    fail_active = !fail_suspended &&
+                  (fail_probability > 0 || fail_every > 0 || fail_after > 0);
+    start_fail_schedule();
+}
+
+/* Suspend or resume failure injection */
+void set_fail_suspended(bool suspended)
+{
+    fail_suspended = suspended;
+    fail_active = !fail_suspended &&
+                  (fail_probability > 0 || fail_every > 0 || fail_after > 0);
+}
+
+/* Return whether allocations may currently fail on purpose */
+bool fail_injection_active()
+{
+    return fail_active;
+}
+
 /* Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
  */
@@ -244,6 +789,8 @@ bool error_check()
 {
     bool e = error_occurred;
     error_occurred = false;
+    if (atomic_load_explicit(&exited_error, memory_order_relaxed))
+        e |= atomic_exchange(&exited_error, false);
     return e;
 }
 
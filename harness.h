@@ -16,14 +16,95 @@ void test_free(void *p);
 char *test_strdup(const char *s);
 /* FIXME: provide test_realloc as well */
 
+/* Variants recording site, a string naming the calling code */
+void *test_malloc_at(size_t size, const char *site);
+char *test_strdup_at(const char *s, const char *site);
+
+/* Allocate size bytes starting at a multiple of align, a power of two */
+void *test_aligned_alloc_at(size_t align, size_t size, const char *site);
+
+/* Number of power-of-two size buckets of the allocation histogram */
+#define ALLOC_HIST_BUCKETS 65
+
+/* Largest number of call sites told apart by alloc_stats() */
+#define ALLOC_MAX_SITES 64
+
+/* Allocations made at one call site */
+typedef struct {
+    const char *site;
+    size_t allocs, frees;
+    size_t live_bytes;
+} alloc_site_t;
+
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* How much of every payload is filled with poison on malloc and free */
+typedef enum {
+    POISON_FULL,   /* The whole payload */
+    POISON_HEADER, /* Only the first and last cache line */
+    POISON_OFF,    /* Nothing */
+    N_POISON
+} poison_mode_t;
+
+extern int poison_mode;
+
+/* Place one in guard_rate allocations right in front of an inaccessible
+ * page, so that overruns fault on the spot. 1 guards every allocation, 0
+ * none.
+ */
+extern int guard_rate;
+
+/* Statistics of the test allocator, summed over all threads */
+typedef struct {
+    size_t allocs, frees; /* Successful calls of malloc and free */
+    size_t guarded;       /* Allocations placed against a guard page */
+    size_t live_blocks;
+    size_t live_bytes;     /* Payload bytes of live blocks */
+    size_t thread_peaks;   /* Sum over threads of their highest live_bytes,
+                            * reached at different times, so no peak itself
+                            */
+    size_t overhead;       /* Bytes the harness adds to every block */
+    size_t poisoned_bytes; /* Bytes filled with poison */
+    /* Allocations of at most 2^i bytes and more than half as many */
+    size_t size_hist[ALLOC_HIST_BUCKETS];
+    int n_sites;
+    alloc_site_t sites[ALLOC_MAX_SITES];
+} alloc_stats_t;
+
+/* Collect statistics of the test allocator */
+void alloc_stats(alloc_stats_t *stats);
+
+/* Report numbers of successful calls of malloc and free so far */
+void alloc_totals(size_t *allocs, size_t *frees);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Fail every Nth allocation, 0 to disable */
+extern int fail_every;
+
+/* Fail allocations once this many bytes have been allocated, 0 to disable */
+extern int fail_after;
+
+/* Seed of the random failures, 0 to pick one at random */
+extern int fail_seed;
+
+/* Restart the failure schedule of the calling thread.
+ * Call after changing any of the parameters above.
+ */
+void reset_fail_schedule();
+
+/* Set/unset suspended failure mode.
+ * In this mode, allocations only fail if memory is exhausted.
+ */
+void set_fail_suspended(bool suspended);
+
+/* Return whether allocations may currently fail on purpose */
+bool fail_injection_active();
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -53,13 +134,20 @@ void trigger_exception(char *msg);
 
 #else /* !INTERNAL */
 
+/* Name of the code calling the allocator, such as "queue.c:42" */
+#define HARNESS_STR_(x) #x
+#define HARNESS_STR(x) HARNESS_STR_(x)
+#define HARNESS_SITE __FILE__ ":" HARNESS_STR(__LINE__)
+
 /* Tested program use our versions of malloc and free */
-#define malloc test_malloc
+#define malloc(size) test_malloc_at(size, HARNESS_SITE)
+#define aligned_alloc(align, size) \
+    test_aligned_alloc_at(align, size, HARNESS_SITE)
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
-#define strdup test_strdup
+#define strdup(s) test_strdup_at(s, HARNESS_SITE)
 
 #endif
 
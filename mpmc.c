@@ -0,0 +1,331 @@
+/* Lock-free concurrent queues of element_t */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpmc.h"
+
+/* Keeps the producer and consumer ends of a queue on separate cache lines */
+#define MPMC_CACHE_LINE 64
+
+/* The first arena chunk holds 1 << MPMC_CHUNK_SHIFT nodes and every further
+ * chunk twice as many as the one before, so that node indices fit 32 bits
+ */
+#define MPMC_CHUNK_SHIFT 10
+#define MPMC_NR_CHUNKS 22
+
+/* Links of the list variant hold a node index in their low half and a
+ * modification count in their high half. Index 0 stands for NULL.
+ */
+#define LINK(idx, cnt) ((uint64_t) (cnt) << 32 | (uint32_t) (idx))
+#define LINK_IDX(link) ((uint32_t) (link))
+#define LINK_CNT(link) ((uint32_t) ((link) >> 32))
+
+typedef struct {
+    atomic_size_t seq; /* Position the slot is ready for */
+    element_t *e;
+} mpmc_cell_t;
+
+typedef struct {
+    _Atomic uint64_t next;
+    _Atomic(element_t *) e;
+} mpmc_node_t;
+
+struct __mpmc {
+    mpmc_kind_t kind;
+
+    /* Ring variant */
+    mpmc_cell_t *cells;
+    size_t mask;
+
+    /* List variant */
+    _Atomic(mpmc_node_t *) chunks[MPMC_NR_CHUNKS];
+    _Atomic uint32_t n_nodes;  /* Nodes handed out from the arena */
+    _Atomic uint64_t free_top; /* Recycled nodes, linked through next */
+
+    /* Producer end: next ring position or tail link */
+    char pad0[MPMC_CACHE_LINE];
+    atomic_size_t enq_pos;
+    _Atomic uint64_t tail;
+
+    /* Consumer end: next ring position or head link */
+    char pad1[MPMC_CACHE_LINE];
+    atomic_size_t deq_pos;
+    _Atomic uint64_t head;
+    char pad2[MPMC_CACHE_LINE];
+};
+
+/* Serializes growing the arena of the list variant. Queue operations
+ * themselves never take it.
+ */
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__thread unsigned long mpmc_retries = 0;
+
+static inline int chunk_of(uint32_t idx)
+{
+    return 63 - __builtin_clzll(((uint64_t) idx >> MPMC_CHUNK_SHIFT) + 1);
+}
+
+static inline mpmc_node_t *node_at(mpmc_t *q, uint32_t idx)
+{
+    int k = chunk_of(idx);
+    mpmc_node_t *chunk = atomic_load_explicit(&q->chunks[k],
+                                              memory_order_acquire);
+    return &chunk[idx - (((uint32_t) 1 << k) - 1) * (1u << MPMC_CHUNK_SHIFT)];
+}
+
+/* Point the link of node at idx, bumping its modification count */
+static inline void node_link(mpmc_node_t *node, uint32_t idx)
+{
+    uint64_t old = atomic_load_explicit(&node->next, memory_order_relaxed);
+    atomic_store_explicit(&node->next, LINK(idx, LINK_CNT(old) + 1),
+                          memory_order_release);
+}
+
+/* Take a node from the free list, or a fresh one from the arena.
+ * Return 0 if the arena could not grow.
+ */
+static uint32_t node_alloc(mpmc_t *q)
+{
+    uint64_t top = atomic_load_explicit(&q->free_top, memory_order_acquire);
+    while (LINK_IDX(top)) {
+        /* The node may be recycled under us, the count in top catches that */
+        uint64_t next = atomic_load_explicit(&node_at(q, LINK_IDX(top))->next,
+                                             memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(
+                &q->free_top, &top, LINK(LINK_IDX(next), LINK_CNT(top) + 1),
+                memory_order_acquire, memory_order_acquire))
+            return LINK_IDX(top);
+    }
+
+    uint32_t idx = atomic_fetch_add(&q->n_nodes, 1);
+    int k = chunk_of(idx);
+    if (k >= MPMC_NR_CHUNKS)
+        return 0;
+    if (!atomic_load_explicit(&q->chunks[k], memory_order_acquire)) {
+        pthread_mutex_lock(&grow_lock);
+        if (!atomic_load_explicit(&q->chunks[k], memory_order_relaxed)) {
+            size_t n = (size_t) 1 << (MPMC_CHUNK_SHIFT + k);
+            mpmc_node_t *chunk = malloc(n * sizeof(mpmc_node_t));
+            if (chunk) {
+                memset(chunk, 0, n * sizeof(mpmc_node_t));
+                atomic_store_explicit(&q->chunks[k], chunk,
+                                      memory_order_release);
+            }
+        }
+        pthread_mutex_unlock(&grow_lock);
+        if (!atomic_load_explicit(&q->chunks[k], memory_order_acquire))
+            return 0;
+    }
+    return idx;
+}
+
+/* Return the node at idx to the free list */
+static void node_free(mpmc_t *q, uint32_t idx)
+{
+    mpmc_node_t *node = node_at(q, idx);
+    uint64_t top = atomic_load_explicit(&q->free_top, memory_order_relaxed);
+    do {
+        node_link(node, LINK_IDX(top));
+    } while (!atomic_compare_exchange_weak_explicit(
+        &q->free_top, &top, LINK(idx, LINK_CNT(top) + 1),
+        memory_order_release, memory_order_relaxed));
+}
+
+static bool ring_enqueue(mpmc_t *q, element_t *e)
+{
+    size_t pos = atomic_load_explicit(&q->enq_pos, memory_order_relaxed);
+    mpmc_cell_t *cell;
+    for (;; mpmc_retries++) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enq_pos, &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* The slot still holds the element from one lap ago */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->enq_pos, memory_order_relaxed);
+        }
+    }
+    cell->e = e;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static element_t *ring_dequeue(mpmc_t *q)
+{
+    size_t pos = atomic_load_explicit(&q->deq_pos, memory_order_relaxed);
+    mpmc_cell_t *cell;
+    for (;; mpmc_retries++) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->deq_pos, &pos,
+                                                      pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* No producer has filled the slot yet */
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&q->deq_pos, memory_order_relaxed);
+        }
+    }
+    element_t *e = cell->e;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return e;
+}
+
+static bool list_enqueue(mpmc_t *q, element_t *e)
+{
+    uint32_t idx = node_alloc(q);
+    if (!idx)
+        return false;
+    mpmc_node_t *node = node_at(q, idx);
+    atomic_store_explicit(&node->e, e, memory_order_relaxed);
+    node_link(node, 0);
+
+    uint64_t tail;
+    for (;; mpmc_retries++) {
+        tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        mpmc_node_t *last = node_at(q, LINK_IDX(tail));
+        uint64_t next = atomic_load_explicit(&last->next, memory_order_acquire);
+        if (tail != atomic_load_explicit(&q->tail, memory_order_acquire))
+            continue;
+        if (LINK_IDX(next) == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &last->next, &next, LINK(idx, LINK_CNT(next) + 1),
+                    memory_order_release, memory_order_relaxed))
+                break;
+        } else {
+            /* Tail is lagging behind, help the other producer along */
+            atomic_compare_exchange_weak_explicit(
+                &q->tail, &tail, LINK(LINK_IDX(next), LINK_CNT(tail) + 1),
+                memory_order_release, memory_order_relaxed);
+        }
+    }
+    atomic_compare_exchange_strong_explicit(&q->tail, &tail,
+                                            LINK(idx, LINK_CNT(tail) + 1),
+                                            memory_order_release,
+                                            memory_order_relaxed);
+    return true;
+}
+
+static element_t *list_dequeue(mpmc_t *q)
+{
+    uint64_t head;
+    element_t *e;
+    for (;; mpmc_retries++) {
+        head = atomic_load_explicit(&q->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        uint64_t next = atomic_load_explicit(
+            &node_at(q, LINK_IDX(head))->next, memory_order_acquire);
+        if (head != atomic_load_explicit(&q->head, memory_order_acquire))
+            continue;
+        if (LINK_IDX(head) == LINK_IDX(tail)) {
+            if (LINK_IDX(next) == 0)
+                return NULL;
+            atomic_compare_exchange_weak_explicit(
+                &q->tail, &tail, LINK(LINK_IDX(next), LINK_CNT(tail) + 1),
+                memory_order_release, memory_order_relaxed);
+        } else {
+            /* Read the element before another consumer can recycle next */
+            e = atomic_load_explicit(&node_at(q, LINK_IDX(next))->e,
+                                     memory_order_relaxed);
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->head, &head, LINK(LINK_IDX(next), LINK_CNT(head) + 1),
+                    memory_order_acq_rel, memory_order_relaxed))
+                break;
+        }
+    }
+    /* The old dummy node goes, next becomes the new dummy */
+    node_free(q, LINK_IDX(head));
+    return e;
+}
+
+mpmc_t *mpmc_new(mpmc_kind_t kind, size_t capacity)
+{
+    mpmc_t *q = malloc(sizeof(mpmc_t));
+    if (!q)
+        return NULL;
+    memset(q, 0, sizeof(mpmc_t));
+    q->kind = kind;
+
+    if (kind == MPMC_RING) {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        q->cells = malloc(n * sizeof(mpmc_cell_t));
+        if (!q->cells) {
+            free(q);
+            return NULL;
+        }
+        for (size_t i = 0; i < n; i++)
+            atomic_init(&q->cells[i].seq, i);
+        q->mask = n - 1;
+        return q;
+    }
+
+    /* Skip index 0 and start with a dummy node */
+    atomic_init(&q->n_nodes, 1);
+    uint32_t dummy = node_alloc(q);
+    if (!dummy) {
+        free(q);
+        return NULL;
+    }
+    atomic_init(&q->head, LINK(dummy, 0));
+    atomic_init(&q->tail, LINK(dummy, 0));
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    if (!q)
+        return;
+    element_t *e;
+    while ((e = mpmc_remove_head(q, NULL, 0)))
+        q_release_element(e);
+    free(q->cells);
+    for (int k = 0; k < MPMC_NR_CHUNKS; k++)
+        free(atomic_load(&q->chunks[k]));
+    free(q);
+}
+
+bool mpmc_insert_tail(mpmc_t *q, char *s)
+{
+    if (!q)
+        return false;
+
+    element_t *e = q_new_element(NULL, s);
+    if (!e)
+        return false;
+    if (q->kind == MPMC_RING ? ring_enqueue(q, e) : list_enqueue(q, e))
+        return true;
+    q_release_element(e);
+    return false;
+}
+
+element_t *mpmc_remove_head(mpmc_t *q, char *sp, size_t bufsize)
+{
+    if (!q)
+        return NULL;
+    element_t *e = q->kind == MPMC_RING ? ring_dequeue(q) : list_dequeue(q);
+    if (e && sp && bufsize) {
+        size_t len = e->len < bufsize - 1 ? e->len : bufsize - 1;
+        memcpy(sp, e->value, len);
+        sp[len] = '\0';
+    }
+    return e;
+}
@@ -0,0 +1,51 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+/* Concurrent queues of element_t that any number of producer and consumer
+ * threads may share.
+ *
+ * Two lock-free variants are provided:
+ * - a bounded ring buffer in which every slot carries a sequence number
+ *   telling producers and consumers whose turn it is, and
+ * - an unbounded linked queue after Michael and Scott. Its nodes live in an
+ *   arena that only grows and are recycled through a free list, with a
+ *   modification count next to every link to defeat the ABA problem.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "queue.h"
+
+typedef enum { MPMC_RING, MPMC_LIST, N_MPMC } mpmc_kind_t;
+
+typedef struct __mpmc mpmc_t;
+
+/* Create an empty concurrent queue. The ring holds capacity elements,
+ * rounded up to a power of two, while the list grows as needed.
+ * Return NULL if allocation failed.
+ */
+mpmc_t *mpmc_new(mpmc_kind_t kind, size_t capacity);
+
+/* Free all storage used by the queue, including the elements still in it.
+ * No other thread may be using the queue.
+ */
+void mpmc_free(mpmc_t *q);
+
+/* Insert a copy of s at the tail of the queue, like q_insert_tail().
+ * Return false if allocation failed or the ring is full.
+ */
+bool mpmc_insert_tail(mpmc_t *q, char *s);
+
+/* Remove the element at the head of the queue, like q_remove_head().
+ * The element is released with q_release_element() by its caller.
+ * Return NULL if the queue is empty.
+ */
+element_t *mpmc_remove_head(mpmc_t *q, char *sp, size_t bufsize);
+
+/* Number of times queue operations of the calling thread had to try again
+ * because another thread got in their way
+ */
+extern __thread unsigned long mpmc_retries;
+
+#endif /* LAB0_MPMC_H */
@@ -0,0 +1,147 @@
+/* Slab and size-class allocator for queue elements */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harness.h"
+#include "pool.h"
+#include "report.h"
+
+/* Bytes carved into objects from each chunk */
+#define POOL_CHUNK_SIZE (16 * 1024)
+
+/* Objects of at least this size start on a cache line of their own */
+#define POOL_ALIGN 64
+
+/* Smallest size class holds 1 << POOL_MIN_SHIFT bytes */
+#define POOL_MIN_SHIFT 5
+
+/* Size classes cover 32 to 2048 bytes, larger requests bypass the pool */
+#define POOL_NR_CLASSES 7
+#define POOL_MAX_SIZE ((size_t) 1 << (POOL_MIN_SHIFT + POOL_NR_CLASSES - 1))
+
+/* Freed objects hold the free-list link, then POOL_FREED, then poison.
+ * Objects in the pool never see test_free, so this is what catches double
+ * frees and writes through dangling pointers, in every build.
+ */
+#define POOL_FREED ((uintptr_t) 0xfee1deadfee1deadULL)
+#define POOL_POISON 0x6b
+
+int alloc_backend = ALLOC_MALLOC;
+
+typedef struct __pool_chunk {
+    struct __pool_chunk *next;
+    unsigned char data[];
+} pool_chunk_t;
+
+typedef struct {
+    void *free_list;           /* Recycled objects, linked via first word */
+    unsigned char *cur, *end;  /* Unused tail of the newest chunk */
+} pool_class_t;
+
+struct __pool {
+    pool_class_t classes[POOL_NR_CLASSES];
+    pool_chunk_t *chunks;
+    size_t live;  /* Objects handed out and not yet returned */
+    bool orphan;  /* The owner has dropped its reference */
+};
+
+/* Index of the smallest size class holding size bytes */
+static inline int pool_class(size_t size)
+{
+    if (size <= ((size_t) 1 << POOL_MIN_SHIFT))
+        return 0;
+    return (int) (sizeof(long) * 8) - __builtin_clzl(size - 1) -
+           POOL_MIN_SHIFT;
+}
+
+pool_t *pool_new()
+{
+    pool_t *pool = malloc(sizeof(pool_t));
+    if (!pool)
+        return NULL;
+    memset(pool, 0, sizeof(pool_t));
+    return pool;
+}
+
+static void pool_destroy(pool_t *pool)
+{
+    pool_chunk_t *chunk = pool->chunks;
+    while (chunk) {
+        pool_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(pool);
+}
+
+void *pool_alloc(pool_t *pool, size_t size)
+{
+    void *p;
+    if (size > POOL_MAX_SIZE) {
+        p = malloc(size);
+        if (p)
+            pool->live++;
+        return p;
+    }
+
+    int idx = pool_class(size);
+    size_t objsize = (size_t) 1 << (POOL_MIN_SHIFT + idx);
+    pool_class_t *c = &pool->classes[idx];
+    if (c->free_list) {
+        p = c->free_list;
+        c->free_list = *(void **) p;
+        unsigned char *b = p;
+        bool intact = ((uintptr_t *) p)[1] == POOL_FREED;
+        for (size_t i = 2 * sizeof(uintptr_t); intact && i < objsize; i++)
+            intact = b[i] == POOL_POISON;
+        if (!intact)
+            report_event(MSG_FATAL,
+                         "Pooled object %p was written after being freed", p);
+        ((uintptr_t *) p)[1] = 0;
+    } else {
+        if ((size_t) (c->end - c->cur) < objsize) {
+            pool_chunk_t *chunk =
+                malloc(sizeof(pool_chunk_t) + POOL_CHUNK_SIZE);
+            if (!chunk)
+                return NULL;
+            chunk->next = pool->chunks;
+            pool->chunks = chunk;
+            c->cur = (unsigned char *) (((uintptr_t) chunk->data +
+                                         POOL_ALIGN - 1) &
+                                        ~(uintptr_t) (POOL_ALIGN - 1));
+            c->end = chunk->data + POOL_CHUNK_SIZE;
+        }
+        p = c->cur;
+        c->cur += objsize;
+    }
+    pool->live++;
+    return p;
+}
+
+void pool_free(pool_t *pool, void *p, size_t size)
+{
+    if (size > POOL_MAX_SIZE) {
+        free(p);
+    } else {
+        int idx = pool_class(size);
+        pool_class_t *c = &pool->classes[idx];
+        if (((uintptr_t *) p)[1] == POOL_FREED)
+            report_event(MSG_FATAL, "Pooled object %p freed twice", p);
+        memset(p, POOL_POISON, (size_t) 1 << (POOL_MIN_SHIFT + idx));
+        ((uintptr_t *) p)[1] = POOL_FREED;
+        *(void **) p = c->free_list;
+        c->free_list = p;
+    }
+
+    if (--pool->live == 0 && pool->orphan)
+        pool_destroy(pool);
+}
+
+void pool_put(pool_t *pool)
+{
+    pool->orphan = true;
+    if (pool->live == 0)
+        pool_destroy(pool);
+}
@@ -0,0 +1,36 @@
+#ifndef LAB0_POOL_H
+#define LAB0_POOL_H
+
+/* Slab and size-class allocator for queue elements.
+ *
+ * Each pool carves fixed-size objects out of large chunks obtained through
+ * the harness allocator, so leak and corruption checking still apply to
+ * the chunks. Objects are grouped into power-of-two size classes and freed
+ * objects are recycled through a per-class free list.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Allocator backing the elements of newly created queues */
+typedef enum { ALLOC_MALLOC, ALLOC_POOL, N_ALLOC } alloc_backend_t;
+
+extern int alloc_backend;
+
+typedef struct __pool pool_t;
+
+/* Create an empty pool.  Return NULL if allocation failed */
+pool_t *pool_new();
+
+/* Allocate an object of size bytes.  Return NULL if allocation failed */
+void *pool_alloc(pool_t *pool, size_t size);
+
+/* Return an object of size bytes previously handed out by pool_alloc */
+void pool_free(pool_t *pool, void *p, size_t size);
+
+/* Drop the owner's reference.  The pool and all of its chunks are released
+ * once every object handed out by it has been returned.
+ */
+void pool_put(pool_t *pool);
+
+#endif /* LAB0_POOL_H */
@@ -0,0 +1,215 @@
+/* Latency profile of the interpreter's commands */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+#include "report.h"
+
+/* Commands are kept in an open-addressing table keyed by name address */
+#define PROFILE_SLOTS 128
+
+typedef struct {
+    const char *name;
+    uint64_t calls;
+    uint64_t total, min, max;
+    uint64_t hist[PROFILE_BUCKETS];
+} cmd_profile_t;
+
+static cmd_profile_t *profiles[PROFILE_SLOTS];
+static int n_profiles = 0;
+
+/* Bucket holding value v */
+static int hist_bucket(uint64_t v)
+{
+    if (v < PROFILE_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - PROFILE_SUB_BITS;
+    return ((shift + 1) << PROFILE_SUB_BITS) +
+           (int) ((v >> shift) & (PROFILE_SUB - 1));
+}
+
+/* Smallest value in bucket b */
+static uint64_t hist_low(int b)
+{
+    if (b < PROFILE_SUB)
+        return b;
+    int shift = (b >> PROFILE_SUB_BITS) - 1;
+    return (uint64_t) (PROFILE_SUB + (b & (PROFILE_SUB - 1))) << shift;
+}
+
+/* Largest value in bucket b */
+static uint64_t hist_high(int b)
+{
+    return b + 1 < PROFILE_BUCKETS ? hist_low(b + 1) - 1 : UINT64_MAX;
+}
+
+/* Value below which fraction q of the calls fall, within the histogram's
+ * precision
+ */
+static uint64_t percentile(const cmd_profile_t *p, double q)
+{
+    uint64_t rank = q * p->calls;
+    uint64_t seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += p->hist[b];
+        if (seen > rank)
+            return hist_high(b) < p->max ? hist_high(b) : p->max;
+    }
+    return p->max;
+}
+
+void profile_record(const char *name, uint64_t cycles)
+{
+    size_t i = ((uintptr_t) name >> 3) & (PROFILE_SLOTS - 1);
+    while (profiles[i] && profiles[i]->name != name)
+        i = (i + 1) & (PROFILE_SLOTS - 1);
+
+    cmd_profile_t *p = profiles[i];
+    if (!p) {
+        /* Leave a slot free so that searches end */
+        if (n_profiles == PROFILE_SLOTS - 1)
+            return;
+        p = profiles[i] = calloc_or_fail(1, sizeof(cmd_profile_t), "profile");
+        p->name = name;
+        p->min = UINT64_MAX;
+        n_profiles++;
+    }
+
+    p->calls++;
+    p->total += cycles;
+    if (cycles < p->min)
+        p->min = cycles;
+    if (cycles > p->max)
+        p->max = cycles;
+    p->hist[hist_bucket(cycles)]++;
+}
+
+void profile_reset()
+{
+    for (int i = 0; i < PROFILE_SLOTS; i++) {
+        if (profiles[i]) {
+            free_block(profiles[i], sizeof(cmd_profile_t));
+            profiles[i] = NULL;
+        }
+    }
+    n_profiles = 0;
+}
+
+static int cmp_total(const void *a, const void *b)
+{
+    const cmd_profile_t *pa = *(cmd_profile_t *const *) a;
+    const cmd_profile_t *pb = *(cmd_profile_t *const *) b;
+    if (pa->total != pb->total)
+        return pa->total < pb->total ? 1 : -1;
+    return strcmp(pa->name, pb->name);
+}
+
+/* Fill sorted with the commands that were called, busiest first, and
+ * return their number
+ */
+static int sorted_profiles(cmd_profile_t *sorted[])
+{
+    int n = 0;
+    for (int i = 0; i < PROFILE_SLOTS; i++)
+        if (profiles[i])
+            sorted[n++] = profiles[i];
+    qsort(sorted, n, sizeof(cmd_profile_t *), cmp_total);
+    return n;
+}
+
+void profile_show()
+{
+    cmd_profile_t *sorted[PROFILE_SLOTS];
+    int n = sorted_profiles(sorted);
+
+    report(1, "%-12s %10s %14s %10s %10s %10s %10s %10s %10s", "command",
+           "calls", "total", "min", "mean", "p50", "p90", "p99", "max");
+    for (int i = 0; i < n; i++) {
+        const cmd_profile_t *p = sorted[i];
+        report(1, "%-12s %10lu %14lu %10lu %10lu %10lu %10lu %10lu %10lu",
+               p->name, (unsigned long) p->calls, (unsigned long) p->total,
+               (unsigned long) p->min, (unsigned long) (p->total / p->calls),
+               (unsigned long) percentile(p, 0.5),
+               (unsigned long) percentile(p, 0.9),
+               (unsigned long) percentile(p, 0.99), (unsigned long) p->max);
+    }
+    report(1, "Times in CPU cycles, percentiles within %d%%",
+           100 / PROFILE_SUB);
+}
+
+static void save_csv(FILE *f, cmd_profile_t *sorted[], int n)
+{
+    fprintf(f, "command,calls,total,min,mean,p50,p90,p99,max\n");
+    for (int i = 0; i < n; i++) {
+        const cmd_profile_t *p = sorted[i];
+        fprintf(f, "\"%s\",%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", p->name,
+                (unsigned long) p->calls, (unsigned long) p->total,
+                (unsigned long) p->min, (unsigned long) (p->total / p->calls),
+                (unsigned long) percentile(p, 0.5),
+                (unsigned long) percentile(p, 0.9),
+                (unsigned long) percentile(p, 0.99), (unsigned long) p->max);
+    }
+}
+
+/* Write name as JSON string.  Command names have no control characters */
+static void json_string(FILE *f, const char *s)
+{
+    putc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            putc('\\', f);
+        putc(*s, f);
+    }
+    putc('"', f);
+}
+
+static void save_json(FILE *f, cmd_profile_t *sorted[], int n)
+{
+    fprintf(f, "{\"unit\": \"cycles\", \"commands\": [");
+    for (int i = 0; i < n; i++) {
+        const cmd_profile_t *p = sorted[i];
+        fprintf(f, "%s\n  {\"command\": ", i ? "," : "");
+        json_string(f, p->name);
+        fprintf(f,
+                ", \"calls\": %lu, \"total\": %lu, \"min\": %lu, "
+                "\"max\": %lu,\n   \"p50\": %lu, \"p90\": %lu, \"p99\": %lu,"
+                "\n   \"histogram\": [",
+                (unsigned long) p->calls, (unsigned long) p->total,
+                (unsigned long) p->min, (unsigned long) p->max,
+                (unsigned long) percentile(p, 0.5),
+                (unsigned long) percentile(p, 0.9),
+                (unsigned long) percentile(p, 0.99));
+        /* Only buckets that were hit, as [low, high, count] */
+        bool first = true;
+        for (int b = 0; b < PROFILE_BUCKETS; b++) {
+            if (!p->hist[b])
+                continue;
+            fprintf(f, "%s[%lu, %lu, %lu]", first ? "" : ", ",
+                    (unsigned long) hist_low(b), (unsigned long) hist_high(b),
+                    (unsigned long) p->hist[b]);
+            first = false;
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "\n]}\n");
+}
+
+bool profile_save(const char *file)
+{
+    FILE *f = fopen(file, "w");
+    if (!f)
+        return false;
+
+    cmd_profile_t *sorted[PROFILE_SLOTS];
+    int n = sorted_profiles(sorted);
+    size_t len = strlen(file);
+    if (len >= 5 && strcmp(file + len - 5, ".json") == 0)
+        save_json(f, sorted, n);
+    else
+        save_csv(f, sorted, n);
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
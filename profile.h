@@ -0,0 +1,36 @@
+#ifndef LAB0_PROFILE_H
+#define LAB0_PROFILE_H
+
+/* Latency profile of the interpreter's commands.
+ *
+ * Every command keeps its call count, total, minimum and maximum time in CPU
+ * cycles, and a log-linear histogram of its latencies.  Each power of two is
+ * split into PROFILE_SUB buckets, so percentiles read from the histogram are
+ * within 1 / PROFILE_SUB of the true value, whatever its magnitude.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PROFILE_SUB_BITS 3
+#define PROFILE_SUB (1 << PROFILE_SUB_BITS)
+#define PROFILE_BUCKETS ((65 - PROFILE_SUB_BITS) << PROFILE_SUB_BITS)
+
+/* Add one call of the command called name that took cycles.  name is
+ * compared by address, as handed out by add_cmd.
+ */
+void profile_record(const char *name, uint64_t cycles);
+
+/* Forget all calls recorded so far, and free the table */
+void profile_reset();
+
+/* Report the table, busiest command first */
+void profile_show();
+
+/* Write the table to file, as JSON with histograms if its name ends with
+ * ".json" and as CSV otherwise.  Return false if the file could not be
+ * written.
+ */
+bool profile_save(const char *file);
+
+#endif /* LAB0_PROFILE_H */
@@ -3,8 +3,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,12 +22,13 @@
 #include <time.h>
 #endif
 
+#include "bench.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
 
 /* Shannon entropy */
-extern double shannon_entropy(const uint8_t *input_data);
+extern double shannon_entropy(const uint8_t *input_data, size_t len);
 extern int show_entropy;
 
 /* Our program needs to use regular malloc/free */
@@ -45,7 +49,9 @@ extern int show_entropy;
 #include "queue.h"
 
 #include "console.h"
+#include "mpmc.h"
 #include "report.h"
+#include "tpool.h"
 
 /* Settable parameters */
 
@@ -53,7 +59,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -77,6 +82,15 @@ static int string_length = MAXSTRING;
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
+/* Names of the values of settable parameters */
+static char *const alloc_names[] = {"malloc", "pool", NULL};
+static char *const layout_names[] = {"list", "array", NULL};
+static char *const sort_names[] = {"merge", "listsort", "radix", NULL};
+static char *const merge_names[] = {"pairwise", "heap", NULL};
+static char *const mpmc_names[] = {"ring", "list", NULL};
+static char *const stress_names[] = {"ring", "list", "mutex", NULL};
+static char *const poison_names[] = {"full", "header", "off", NULL};
+
 /* Forward declarations */
 static bool q_show(int vlevel);
 
@@ -95,9 +109,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = ((uintptr_t) &current->chain.next == (uintptr_t) &chain.head)
@@ -111,7 +122,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -134,11 +144,23 @@ static bool do_free(int argc, char *argv[])
 
 static bool do_new(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
     }
 
+    int layout = queue_layout;
+    if (argc == 2) {
+        for (layout = 0; layout < N_LAYOUT; layout++) {
+            if (!strcmp(argv[1], layout_names[layout]))
+                break;
+        }
+        if (layout == N_LAYOUT) {
+            report(1, "Unknown layout '%s'", argv[1]);
+            return false;
+        }
+    }
+
     bool ok = true;
 
     if (exception_setup(true)) {
@@ -146,7 +168,10 @@ static bool do_new(int argc, char *argv[])
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
+        int saved_layout = queue_layout;
+        queue_layout = layout;
         qctx->q = q_new();
+        queue_layout = saved_layout;
         qctx->id = chain.size++;
 
         current = qctx;
@@ -172,6 +197,66 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Number of strings handed to q_insert_{head,tail}_bulk() at a time */
+#define INSERT_BATCH 1024
+
+/* Insert reps copies of inserts, or reps random strings if need_rand is set,
+ * through the bulk insertion functions
+ */
+static bool insert_bulk(bool at_tail, char *inserts, bool need_rand, int reps)
+{
+    char *sv[INSERT_BATCH];
+    char randstrs[INSERT_BATCH][MAX_RANDSTR_LEN];
+    bool ok = true;
+    for (int done = 0; ok && done < reps; done += INSERT_BATCH) {
+        int n = reps - done < INSERT_BATCH ? reps - done : INSERT_BATCH;
+        for (int i = 0; i < n; i++) {
+            sv[i] = inserts;
+            if (need_rand) {
+                fill_rand_string(randstrs[i], MAX_RANDSTR_LEN);
+                sv[i] = randstrs[i];
+            }
+        }
+
+        bool rval = at_tail ? q_insert_tail_bulk(current->q, sv, n)
+                            : q_insert_head_bulk(current->q, sv, n);
+        if (!rval) {
+            fail_count++;
+            if (fail_count < fail_limit)
+                report(2, "Insertion of %d strings failed", n);
+            else {
+                report(1,
+                       "ERROR: Insertion of %d strings failed (%d failures "
+                       "total)",
+                       n, fail_count);
+                ok = false;
+            }
+            continue;
+        }
+
+        current->size += n;
+        /* The element of sv[n - 1] is the outermost one */
+        char *cur_inserts = q_peek(current->q, at_tail, 0)->value;
+        if (!cur_inserts) {
+            report(1, "ERROR: Failed to save copy of string in queue");
+            ok = false;
+        } else if (cur_inserts == sv[n - 1]) {
+            report(1,
+                   "ERROR: Need to allocate and copy string for new queue "
+                   "element");
+            ok = false;
+        } else if (n > 1 &&
+                   cur_inserts == q_peek(current->q, at_tail, 1)->value) {
+            report(1,
+                   "ERROR: Need to allocate separate string for each queue "
+                   "element");
+            ok = false;
+        }
+        ok = ok && !error_check();
+    }
+    return ok;
+}
+
 /* insert head */
 static bool do_ih(int argc, char *argv[])
 {
@@ -216,15 +301,20 @@ static bool do_ih(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
-    if (current && exception_setup(true)) {
+    /* Repeated insertions go through the bulk path unless allocations may
+     * fail, in which case each failure is counted separately
+     */
+    if (current && reps > 1 && !fail_injection_active()) {
+        if (exception_setup(true))
+            ok = insert_bulk(false, inserts, need_rand, reps);
+    } else if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_head(current->q, inserts);
             if (rval) {
                 current->size++;
-                char *cur_inserts =
-                    list_entry(current->q->next, element_t, list)->value;
+                char *cur_inserts = q_peek(current->q, false, 0)->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -305,15 +395,17 @@ static bool do_it(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
-    if (current && exception_setup(true)) {
+    if (current && reps > 1 && !fail_injection_active()) {
+        if (exception_setup(true))
+            ok = insert_bulk(true, inserts, need_rand, reps);
+    } else if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
                 fill_rand_string(randstr_buf, sizeof(randstr_buf));
             bool rval = q_insert_tail(current->q, inserts);
             if (rval) {
                 current->size++;
-                char *cur_inserts =
-                    list_entry(current->q->prev, element_t, list)->value;
+                char *cur_inserts = q_peek(current->q, true, 0)->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
@@ -406,6 +498,10 @@ static bool do_remove(int option, int argc, char *argv[])
     bool is_null = re ? false : true;
 
     if (!is_null) {
+        /* The copy holds the whole string unless it got truncated */
+        size_t expect_len = re->len < (size_t) string_length
+                                ? re->len
+                                : (size_t) string_length;
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
         q_release_element(re);
@@ -414,6 +510,11 @@ static bool do_remove(int option, int argc, char *argv[])
         if (removes[0] == '\0') {
             report(1, "ERROR: Failed to store removed value");
             ok = false;
+        } else if (strlen(removes) != expect_len) {
+            report(1, "ERROR: Removed value has %lu bytes instead of %lu",
+                   (unsigned long) strlen(removes),
+                   (unsigned long) expect_len);
+            ok = false;
         }
 
         /* Check whether padding in array removes are still initial value 'X'.
@@ -465,6 +566,88 @@ static inline bool do_rt(int argc, char *argv[])
     return do_remove(1, argc, argv);
 }
 
+/* Number of elements drained by one call of q_remove_{head,tail}_n() */
+#define REMOVE_BATCH 1024
+
+static bool do_remove_n(int option, int argc, char *argv[])
+{
+    // option 0 is for remove head; option 1 is for remove tail
+    int n = 1;
+    if (argc != 2 || !get_int(argv[1], &n) || n < 1) {
+        report(1, "%s needs a positive number of elements", argv[0]);
+        return false;
+    }
+
+    size_t bufsize = (size_t) REMOVE_BATCH * (string_length + 1);
+    char *removes = malloc(bufsize);
+    if (!removes) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        return false;
+    }
+
+    if (!current || current->size < n)
+        report(3, "Warning: Removing %d elements from a shorter queue", n);
+    error_check();
+
+    int removed = 0;
+    bool ok = true;
+    if (current && exception_setup(true)) {
+        while (ok && removed < n) {
+            int want = n - removed < REMOVE_BATCH ? n - removed : REMOVE_BATCH;
+            int copied;
+            int got = option ? q_remove_tail_n(current->q, want, removes,
+                                               bufsize, &copied)
+                             : q_remove_head_n(current->q, want, removes,
+                                               bufsize, &copied);
+            removed += got;
+            current->size -= got;
+
+            /* Strings that did not fit were removed without a copy */
+            char *str = removes;
+            for (int i = 0; i < copied; i++) {
+                report(4, "Removed %s from queue", str);
+                str += strlen(str) + 1;
+            }
+            ok = !error_check();
+            /* The queue ran out, which is reported below */
+            if (got < want)
+                break;
+        }
+    }
+    exception_cancel();
+
+    if (removed < n) {
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Removed only %d of %d elements from queue", removed, n);
+        } else {
+            report(1,
+                   "ERROR: Removed only %d of %d elements from queue (%d "
+                   "failures total)",
+                   removed, n, fail_count);
+            ok = false;
+        }
+    } else {
+        report(2, "Removed %d elements from queue", removed);
+    }
+
+    q_show(3);
+
+    free(removes);
+    return ok && !error_check();
+}
+
+static inline bool do_rhn(int argc, char *argv[])
+{
+    return do_remove_n(0, argc, argv);
+}
+
+static inline bool do_rtn(int argc, char *argv[])
+{
+    return do_remove_n(1, argc, argv);
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -476,6 +659,7 @@ static bool do_dedup(int argc, char *argv[])
     element_t *item = NULL, *tmp = NULL;
 
     // Copy current->q to l_copy
+    q_links(current->q);
     if (current->q && !list_empty(current->q)) {
         list_for_each_entry (item, current->q, list) {
             size_t slen;
@@ -490,6 +674,8 @@ static bool do_dedup(int argc, char *argv[])
                 break;
             }
             memcpy(tmp->value, item->value, slen);
+            tmp->len = item->len;
+            tmp->flags = 0;
             list_add_tail(&tmp->list, &l_copy);
         }
         // Return false if the loop does not leave properly
@@ -519,21 +705,22 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
+    q_links(current->q);
     struct list_head *l_tmp = current->q->next;
     bool is_this_dup = false;
     // Compare between new list and old one
     list_for_each_entry (item, &l_copy, list) {
         // Skip comparison with new list if the string is duplicate
-        bool is_next_dup =
-            item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
+        const element_t *next = list_entry(item->list.next, element_t, list);
+        bool is_next_dup = item->list.next != &l_copy &&
+                           next->len == item->len &&
+                           strcmp(next->value, item->value) == 0;
+        const element_t *kept = list_entry(l_tmp, element_t, list);
         if (is_this_dup || is_next_dup) {
             // Update list size
             current->size--;
-        } else if (l_tmp != current->q &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
+        } else if (l_tmp != current->q && kept->len == item->len &&
+                   strcmp(kept->value, item->value) == 0)
             l_tmp = l_tmp->next;
         else
             ok = false;
@@ -646,10 +833,13 @@ bool do_sort(int argc, char *argv[])
     if (current && exception_setup(true))
         q_sort(current->q);
     exception_cancel();
+    /* Workers may be left sorting if the time limit hit */
+    tpool_wait();
     set_noallocate_mode(false);
 
     bool ok = true;
     if (current && current->size) {
+        q_links(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
@@ -737,6 +927,7 @@ static bool do_descend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
+        q_links(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
             element_t *item, *next_item;
@@ -804,7 +995,7 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -823,6 +1014,7 @@ static bool do_merge(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
+        q_links(current->q);
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --len; cur_l = cur_l->next) {
             /* Ensure each element in ascending order */
@@ -874,6 +1066,7 @@ static bool q_show(int vlevel)
         return true;
     }
 
+    q_links(current->q);
     if (!is_circular()) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
@@ -892,7 +1085,7 @@ static bool q_show(int vlevel)
                 if (show_entropy) {
                     report_noreturn(
                         vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
+                        shannon_entropy((const uint8_t *) e->value, e->len));
                 }
             }
             cnt++;
@@ -995,9 +1188,857 @@ static bool do_shuffle(int argc, char *argv[])
     return !error_check();
 }
 */
+/* Input orders exercised by sortbench */
+typedef enum {
+    BENCH_RANDOM,
+    BENCH_SORTED,
+    BENCH_REVERSED,
+    BENCH_DUPLICATES,
+    N_BENCH
+} bench_input_t;
+
+static char *const bench_input_names[] = {"random", "sorted", "reversed",
+                                          "dups"};
+
+/* Number of distinct strings in the BENCH_DUPLICATES input */
+#define BENCH_DISTINCT 16
+
+static int cmp_bench_string(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+/* Fill n records of MAX_RANDSTR_LEN bytes with strings in the given order */
+static void fill_bench_strings(char *strings, int n, bench_input_t input)
+{
+    size_t width = MAX_RANDSTR_LEN;
+    int distinct = input == BENCH_DUPLICATES && n > BENCH_DISTINCT
+                       ? BENCH_DISTINCT
+                       : n;
+    for (int i = 0; i < distinct; i++)
+        fill_rand_string(strings + i * width, width);
+    for (int i = distinct; i < n; i++)
+        memcpy(strings + i * width, strings + (rand() % distinct) * width,
+               width);
+
+    if (input == BENCH_SORTED || input == BENCH_REVERSED)
+        qsort(strings, n, width, cmp_bench_string);
+
+    if (input == BENCH_REVERSED) {
+        char tmp[MAX_RANDSTR_LEN];
+        for (int i = 0, j = n - 1; i < j; i++, j--) {
+            memcpy(tmp, strings + i * width, width);
+            memcpy(strings + i * width, strings + j * width, width);
+            memcpy(strings + j * width, tmp, width);
+        }
+    }
+}
+
+/* Sort a queue of the n strings with every engine behind q_sort(), both
+ * with and without the prefix keys
+ */
+static bool sortbench_run(const char *strings, int n, bench_input_t input)
+{
+    bool ok = true;
+    for (int run = 0; ok && run < 2 * N_SORT; run++) {
+        int alg = run / 2;
+        char engine[32];
+        snprintf(engine, sizeof(engine), "%s%s", sort_names[alg],
+                 run % 2 ? "+key" : "");
+
+        struct list_head *q = q_new();
+        for (int i = 0; q && i < n; i++) {
+            if (!q_insert_tail(q, (char *) strings + i * MAX_RANDSTR_LEN)) {
+                ok = false;
+                break;
+            }
+        }
+        if (!q || !ok) {
+            report(1, "ERROR: Could not build queue for %s", engine);
+            q_free(q);
+            return false;
+        }
+
+        bench_t b;
+        sort_alg = alg;
+        key_prefix = run % 2;
+        q_sort_compares = 0;
+        set_noallocate_mode(true);
+        if (exception_setup(false)) {
+            bench_start(&b);
+            q_sort(q);
+            bench_stop(&b);
+        } else {
+            ok = false;
+        }
+        exception_cancel();
+        set_noallocate_mode(false);
+
+        q_links(q);
+        for (struct list_head *cur = q->next; ok && cur->next != q;
+             cur = cur->next) {
+            if (strcmp(list_entry(cur, element_t, list)->value,
+                       list_entry(cur->next, element_t, list)->value) > 0) {
+                report(1, "ERROR: %s did not sort in ascending order",
+                       engine);
+                ok = false;
+            }
+        }
+
+        if (ok) {
+            char misses[32] = "n/a";
+            if (b.cache_misses >= 0)
+                snprintf(misses, sizeof(misses), "%ld",
+                         (long) b.cache_misses);
+            report(1, "%-9s %-12s %9d %12lu %10.3f %11.1f %14s",
+                   bench_input_names[input], engine, n,
+                   (unsigned long) q_sort_compares, b.seconds * 1000,
+                   (double) b.cycles / n, misses);
+        }
+        q_free(q);
+    }
+    return ok;
+}
+
+/* Compare the sorting engines on identical inputs of growing size */
+static bool do_sortbench(int argc, char *argv[])
+{
+    int min_n = 1000, max_n = 1000000;
+    if (argc > 3 || (argc > 1 && (!get_int(argv[1], &min_n) || min_n < 1)) ||
+        (argc > 2 && (!get_int(argv[2], &max_n) || max_n < min_n))) {
+        report(1, "%s takes optional minimum and maximum numbers of elements",
+               argv[0]);
+        return false;
+    }
+    if (argc == 2)
+        max_n = min_n;
+
+    char *strings = malloc((size_t) max_n * MAX_RANDSTR_LEN);
+    if (!strings) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for strings");
+        return false;
+    }
+
+    int saved_alg = sort_alg;
+    int saved_prefix = key_prefix;
+    set_fail_suspended(true);
+    error_check();
+
+    bool ok = true;
+    report(1, "%-9s %-12s %9s %12s %10s %11s %14s", "input", "engine",
+           "elements", "compares", "msec", "cycles/elem", "cache misses");
+    for (long n = min_n; ok && n <= max_n; n *= 10) {
+        for (int input = 0; ok && input < N_BENCH; input++) {
+            fill_bench_strings(strings, n, input);
+            ok = sortbench_run(strings, n, input);
+        }
+    }
+
+    sort_alg = saved_alg;
+    key_prefix = saved_prefix;
+    set_fail_suspended(false);
+    free(strings);
+    return ok && !error_check();
+}
+
+/* Capacity of the ring exercised by the mpmc command */
+#define MPMC_RING_SIZE 1024
+
+/* State of one producer or consumer thread of the mpmc command */
+typedef struct {
+    mpmc_t *q;
+    int id;
+    int n;                /* Elements inserted by every producer */
+    int producers;        /* Number of producers */
+    atomic_int *consumed; /* Elements removed by all consumers so far */
+    uint64_t *lat;        /* Latency of every completed operation in ns */
+    int n_lat;
+    bool ok;
+} mpmc_worker_t;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *mpmc_producer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    char buf[32];
+    for (int i = 0; i < w->n; i++) {
+        snprintf(buf, sizeof(buf), "p%d_%d", w->id, i);
+        for (;;) {
+            uint64_t start = now_ns();
+            if (mpmc_insert_tail(w->q, buf)) {
+                w->lat[w->n_lat++] = now_ns() - start;
+                break;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *mpmc_consumer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    int total = w->n * w->producers;
+    int *last = malloc(w->producers * sizeof(int));
+    if (!last) {
+        w->ok = false;
+        return NULL;
+    }
+    for (int p = 0; p < w->producers; p++)
+        last[p] = -1;
+
+    char buf[32];
+    while (atomic_load(w->consumed) < total) {
+        uint64_t start = now_ns();
+        element_t *e = mpmc_remove_head(w->q, buf, sizeof(buf));
+        if (!e) {
+            sched_yield();
+            continue;
+        }
+        w->lat[w->n_lat++] = now_ns() - start;
+        atomic_fetch_add(w->consumed, 1);
+
+        /* Elements of every producer must come out in the order it
+         * inserted them
+         */
+        int p, i;
+        if (sscanf(buf, "p%d_%d", &p, &i) != 2 || p < 0 ||
+            p >= w->producers || i <= last[p])
+            w->ok = false;
+        else
+            last[p] = i;
+        q_release_element(e);
+    }
+    free(last);
+    return NULL;
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Report percentiles of the latencies recorded by workers */
+static bool report_latency(const char *op, mpmc_worker_t *workers, int nw)
+{
+    size_t n = 0;
+    for (int i = 0; i < nw; i++)
+        n += workers[i].n_lat;
+    uint64_t *lat = malloc((n ? n : 1) * sizeof(uint64_t));
+    if (!lat) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for latencies");
+        return false;
+    }
+    n = 0;
+    for (int i = 0; i < nw; i++) {
+        memcpy(lat + n, workers[i].lat, workers[i].n_lat * sizeof(uint64_t));
+        n += workers[i].n_lat;
+    }
+    if (n) {
+        qsort(lat, n, sizeof(uint64_t), cmp_latency);
+        report(1, "%-12s latency ns: p50 %lu  p99 %lu  p99.9 %lu  max %lu", op,
+               (unsigned long) lat[n / 2], (unsigned long) lat[n * 99 / 100],
+               (unsigned long) lat[n * 999 / 1000],
+               (unsigned long) lat[n - 1]);
+    }
+    free(lat);
+    return true;
+}
+
+/* Run producer and consumer threads against a concurrent queue */
+static bool do_mpmc(int argc, char *argv[])
+{
+    int kind = -1, producers = 2, consumers = 2, n = 100000;
+    if (argc > 1) {
+        for (int k = 0; k < N_MPMC; k++) {
+            if (!strcmp(argv[1], mpmc_names[k]))
+                kind = k;
+        }
+    }
+    if (argc < 2 || argc > 5 || kind < 0 ||
+        (argc > 2 && (!get_int(argv[2], &producers) || producers < 1)) ||
+        (argc > 3 && (!get_int(argv[3], &consumers) || consumers < 1)) ||
+        (argc > 4 && (!get_int(argv[4], &n) || n < 1))) {
+        report(1,
+               "%s takes a queue kind (ring|list) and optional numbers of "
+               "producers, consumers and elements per producer",
+               argv[0]);
+        return false;
+    }
+
+    set_fail_suspended(true);
+    error_check();
+
+    bool ok = true;
+    int nw = producers + consumers;
+    mpmc_t *q = mpmc_new(kind, MPMC_RING_SIZE);
+    mpmc_worker_t *workers = calloc(nw, sizeof(mpmc_worker_t));
+    pthread_t *threads = calloc(nw, sizeof(pthread_t));
+    atomic_int consumed = 0;
+    if (!q || !workers || !threads) {
+        report(1, "ERROR: Could not allocate %s queue", mpmc_names[kind]);
+        ok = false;
+        goto out;
+    }
+    for (int i = 0; ok && i < nw; i++) {
+        mpmc_worker_t *w = &workers[i];
+        w->q = q;
+        w->id = i < producers ? i : i - producers;
+        w->n = n;
+        w->producers = producers;
+        w->consumed = &consumed;
+        w->ok = true;
+        w->lat = malloc((size_t) (i < producers ? n : n * producers) *
+                        sizeof(uint64_t));
+        if (!w->lat) {
+            report(1, "INTERNAL ERROR.  Could not allocate space for "
+                      "latencies");
+            ok = false;
+        }
+    }
+
+    /* Keep signals away from the threads, and defer them on this one until
+     * every thread has been joined
+     */
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    bench_t b;
+    bench_start(&b);
+    int started = 0;
+    for (; ok && started < nw; started++) {
+        if (pthread_create(&threads[started], NULL,
+                           started < producers ? mpmc_producer : mpmc_consumer,
+                           &workers[started])) {
+            report(1, "ERROR: Could not start thread %d", started);
+            ok = false;
+            break;
+        }
+    }
+    /* Without all of its threads the run cannot finish, so unblock it */
+    if (!ok)
+        atomic_store(&consumed, n * producers);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    bench_stop(&b);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    for (int i = producers; ok && i < nw; i++) {
+        if (!workers[i].ok) {
+            report(1, "ERROR: Elements of a producer came out of order");
+            ok = false;
+        }
+    }
+    if (ok) {
+        long total = (long) n * producers;
+        report(1,
+               "%s: %d producers, %d consumers, %ld elements in %.3f msec, "
+               "%.0f elements/sec",
+               mpmc_names[kind], producers, consumers, total, b.seconds * 1000,
+               total / b.seconds);
+        ok = report_latency("insert_tail", workers, producers) &&
+             report_latency("remove_head", workers + producers, consumers);
+    }
+
+out:
+    if (workers) {
+        for (int i = 0; i < nw; i++)
+            free(workers[i].lat);
+    }
+    free(workers);
+    free(threads);
+    mpmc_free(q);
+    set_fail_suspended(false);
+    return ok && !error_check();
+}
+
+/* The stress command drives the lock-free queues, indexed by mpmc_kind_t,
+ * and a list queue behind a mutex as baseline
+ */
+#define STRESS_MUTEX N_MPMC
+
+/* Latency histogram buckets: values below 4 ns get their own bucket, larger
+ * ones are split into four buckets per power of two
+ */
+#define LAT_SUB_BITS 2
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+
+static inline int lat_bucket(uint64_t ns)
+{
+    if (ns < (1 << LAT_SUB_BITS))
+        return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+           ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* Largest latency falling into bucket b */
+static uint64_t lat_bucket_max(int b)
+{
+    if (b < (1 << LAT_SUB_BITS))
+        return b;
+    int msb = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    uint64_t sub = b & ((1 << LAT_SUB_BITS) - 1);
+    uint64_t low = ((1 << LAT_SUB_BITS) + sub) << (msb - LAT_SUB_BITS);
+    return low + ((uint64_t) 1 << (msb - LAT_SUB_BITS)) - 1;
+}
+
+/* State of one thread of the stress command */
+typedef struct {
+    int kind;
+    mpmc_t *mq;
+    struct list_head *lq;  /* Queue of the mutex baseline */
+    pthread_mutex_t *lock; /* Lock of the mutex baseline */
+    atomic_bool *stop;
+    bool producer;
+    unsigned long ops;       /* Completed operations */
+    unsigned long misses;    /* Operations finding the queue full or empty */
+    unsigned long contended; /* Lock waits or lock-free retries */
+    unsigned long hist[LAT_BUCKETS];
+} stress_worker_t;
+
+static void *stress_thread(void *arg)
+{
+    stress_worker_t *w = arg;
+    char buf[32];
+    snprintf(buf, sizeof(buf), "stress%p", (void *) w);
+    mpmc_retries = 0;
+
+    while (!atomic_load_explicit(w->stop, memory_order_relaxed)) {
+        bool done;
+        uint64_t start = now_ns();
+        if (w->kind == STRESS_MUTEX) {
+            if (pthread_mutex_trylock(w->lock)) {
+                w->contended++;
+                pthread_mutex_lock(w->lock);
+            }
+            if (w->producer) {
+                done = q_insert_tail(w->lq, buf);
+            } else {
+                element_t *e = q_remove_head(w->lq, buf, sizeof(buf));
+                if (e)
+                    q_release_element(e);
+                done = e != NULL;
+            }
+            pthread_mutex_unlock(w->lock);
+        } else if (w->producer) {
+            done = mpmc_insert_tail(w->mq, buf);
+        } else {
+            element_t *e = mpmc_remove_head(w->mq, buf, sizeof(buf));
+            if (e)
+                q_release_element(e);
+            done = e != NULL;
+        }
+        uint64_t ns = now_ns() - start;
+
+        if (!done) {
+            w->misses++;
+            sched_yield();
+            continue;
+        }
+        w->ops++;
+        w->hist[lat_bucket(ns)]++;
+    }
+
+    if (w->kind != STRESS_MUTEX)
+        w->contended = mpmc_retries;
+    return NULL;
+}
+
+/* Summarize the threads of one role and print their latency histogram */
+static void stress_report(const char *op, stress_worker_t *workers, int nw)
+{
+    unsigned long hist[LAT_BUCKETS] = {0}, ops = 0, misses = 0, contended = 0;
+    for (int i = 0; i < nw; i++) {
+        ops += workers[i].ops;
+        misses += workers[i].misses;
+        contended += workers[i].contended;
+        for (int b = 0; b < LAT_BUCKETS; b++)
+            hist[b] += workers[i].hist[b];
+    }
+
+    uint64_t pct[3] = {0};
+    const unsigned long rank[3] = {ops / 2, ops * 99 / 100, ops * 999 / 1000};
+    unsigned long seen = 0;
+    for (int b = 0, p = 0; b < LAT_BUCKETS && p < 3; b++) {
+        seen += hist[b];
+        while (p < 3 && seen > rank[p])
+            pct[p++] = lat_bucket_max(b);
+    }
+    report(1,
+           "%-12s %10lu ops  %8lu full/empty  %8lu contended  latency ns: "
+           "p50 %lu  p99 %lu  p999 %lu",
+           op, ops, misses, contended, (unsigned long) pct[0],
+           (unsigned long) pct[1], (unsigned long) pct[2]);
+
+    /* One line per power of two */
+    for (int b = 0; b < LAT_BUCKETS; b += 1 << LAT_SUB_BITS) {
+        unsigned long count = 0;
+        for (int i = 0; i < (1 << LAT_SUB_BITS); i++)
+            count += hist[b + i];
+        if (count)
+            report(3, "  <= %10lu ns: %lu",
+                   (unsigned long) lat_bucket_max(b + (1 << LAT_SUB_BITS) - 1),
+                   count);
+    }
+}
+
+/* Hammer a shared queue with producer and consumer threads for a while */
+static bool do_stress(int argc, char *argv[])
+{
+    int kind = -1, producers = 2, consumers = 2, msec = 1000;
+    if (argc > 1) {
+        for (int k = 0; stress_names[k]; k++) {
+            if (!strcmp(argv[1], stress_names[k]))
+                kind = k;
+        }
+    }
+    if (argc < 2 || argc > 5 || kind < 0 ||
+        (argc > 2 && (!get_int(argv[2], &producers) || producers < 0)) ||
+        (argc > 3 && (!get_int(argv[3], &consumers) || consumers < 0)) ||
+        (argc > 4 && (!get_int(argv[4], &msec) || msec < 1)) ||
+        producers + consumers < 1) {
+        report(1,
+               "%s takes a queue kind (ring|list|mutex) and optional numbers "
+               "of producers, consumers and milliseconds to run",
+               argv[0]);
+        return false;
+    }
+
+    set_fail_suspended(true);
+    error_check();
+
+    bool ok = true;
+    int nw = producers + consumers;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    atomic_bool stop = false;
+    struct list_head *lq = NULL;
+    mpmc_t *mq = NULL;
+    if (kind == STRESS_MUTEX)
+        lq = q_new();
+    else
+        mq = mpmc_new(kind, MPMC_RING_SIZE);
+    stress_worker_t *workers = calloc(nw, sizeof(stress_worker_t));
+    pthread_t *threads = calloc(nw, sizeof(pthread_t));
+    if ((!lq && !mq) || !workers || !threads) {
+        report(1, "ERROR: Could not allocate %s queue", stress_names[kind]);
+        ok = false;
+        goto out;
+    }
+    for (int i = 0; i < nw; i++) {
+        workers[i].kind = kind;
+        workers[i].mq = mq;
+        workers[i].lq = lq;
+        workers[i].lock = &lock;
+        workers[i].stop = &stop;
+        workers[i].producer = i < producers;
+    }
+
+    /* As in do_mpmc(), signals wait until every thread has been joined */
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    bench_t b;
+    bench_start(&b);
+    int started = 0;
+    for (; started < nw; started++) {
+        if (pthread_create(&threads[started], NULL, stress_thread,
+                           &workers[started])) {
+            report(1, "ERROR: Could not start thread %d", started);
+            ok = false;
+            break;
+        }
+    }
+    if (ok) {
+        struct timespec ts = {msec / 1000, (msec % 1000) * 1000000L};
+        while (nanosleep(&ts, &ts))
+            ;
+    }
+    atomic_store(&stop, true);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    bench_stop(&b);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (ok) {
+        unsigned long ops = 0;
+        for (int i = 0; i < nw; i++)
+            ops += workers[i].ops;
+        report(1,
+               "%s: %d producers, %d consumers, %lu operations in %.3f msec, "
+               "%.0f ops/sec",
+               stress_names[kind], producers, consumers, ops, b.seconds * 1000,
+               ops / b.seconds);
+        if (producers)
+            stress_report("insert_tail", workers, producers);
+        if (consumers)
+            stress_report("remove_head", workers + producers, consumers);
+    }
+
+out:
+    free(workers);
+    free(threads);
+    q_free(lq);
+    mpmc_free(mq);
+    set_fail_suspended(false);
+    return ok && !error_check();
+}
+
+/* Allocations made by every command, gathered by cmd_memstats() */
+#define MAX_CMD_STATS 64
+
+typedef struct {
+    const char *name;
+    unsigned long calls;
+    size_t allocs, frees;
+} cmd_stats_t;
+
+static cmd_stats_t cmd_stats[MAX_CMD_STATS];
+static int n_cmd_stats = 0;
+
+/* Dump allocator statistics when the program exits */
+static int exit_stats = 0;
+
+/* Count the allocations of every command. Each count sweeps all trackers
+ * twice, so this is off unless asked for.
+ */
+static int cmd_stats_on = 0;
+static bool cmd_started = false; /* The hook saw the current command start */
+
+static void cmd_memstats(const char *name, bool done)
+{
+    static size_t start_allocs, start_frees;
+    /* The command turning counting on has no start */
+    if (done && !cmd_started)
+        return;
+    size_t allocs, frees;
+    alloc_totals(&allocs, &frees);
+    cmd_started = !done;
+    if (!done) {
+        start_allocs = allocs;
+        start_frees = frees;
+        return;
+    }
+
+    /* Names come from add_cmd() and stay put, so comparing their addresses
+     * is enough
+     */
+    int i = 0;
+    while (i < n_cmd_stats && cmd_stats[i].name != name)
+        i++;
+    if (i == n_cmd_stats) {
+        if (i == MAX_CMD_STATS)
+            return;
+        cmd_stats[n_cmd_stats++].name = name;
+    }
+    cmd_stats[i].calls++;
+    cmd_stats[i].allocs += allocs - start_allocs;
+    cmd_stats[i].frees += frees - start_frees;
+}
+
+static int cmp_site(const void *a, const void *b)
+{
+    const alloc_site_t *sa = a, *sb = b;
+    if (sa->allocs != sb->allocs)
+        return sa->allocs < sb->allocs ? 1 : -1;
+    return strcmp(sa->site, sb->site);
+}
+
+static void report_memstats()
+{
+    alloc_stats_t *stats = malloc_or_fail(sizeof(alloc_stats_t), "memstats");
+    alloc_stats(stats);
+
+    report(1, "Allocations: %lu, frees: %lu", (unsigned long) stats->allocs,
+           (unsigned long) stats->frees);
+    report(1, "Live: %lu blocks, %lu bytes (+%lu bytes harness overhead)",
+           (unsigned long) stats->live_blocks,
+           (unsigned long) stats->live_bytes,
+           (unsigned long) (stats->live_blocks * stats->overhead));
+    report(1, "Sum of per-thread peaks: %lu bytes",
+           (unsigned long) stats->thread_peaks);
+    report(1, "Guarded %lu allocations (guard %d)",
+           (unsigned long) stats->guarded, guard_rate);
+    report(1, "Poisoned %lu bytes (poison %s)",
+           (unsigned long) stats->poisoned_bytes, poison_names[poison_mode]);
+
+    report(1, "%12s %12s", "size <=", "allocs");
+    for (int i = 0; i < ALLOC_HIST_BUCKETS; i++) {
+        if (!stats->size_hist[i])
+            continue;
+        if (i < 64)
+            report(1, "%12lu %12lu", 1UL << i,
+                   (unsigned long) stats->size_hist[i]);
+        else
+            report(1, "%12s %12lu", "more",
+                   (unsigned long) stats->size_hist[i]);
+    }
+
+    qsort(stats->sites, stats->n_sites, sizeof(alloc_site_t), cmp_site);
+    report(1, "%-24s %10s %10s %12s", "site", "allocs", "frees", "live bytes");
+    for (int i = 0; i < stats->n_sites; i++)
+        report(1, "%-24s %10lu %10lu %12lu", stats->sites[i].site,
+               (unsigned long) stats->sites[i].allocs,
+               (unsigned long) stats->sites[i].frees,
+               (unsigned long) stats->sites[i].live_bytes);
+
+    if (!n_cmd_stats)
+        report(1, "Allocations per command: see option cmdstats");
+    else
+        report(1, "%-24s %10s %10s %12s", "command", "calls", "allocs",
+               "frees");
+    for (int i = 0; i < n_cmd_stats; i++)
+        report(1, "%-24s %10lu %10lu %12lu", cmd_stats[i].name,
+               cmd_stats[i].calls, (unsigned long) cmd_stats[i].allocs,
+               (unsigned long) cmd_stats[i].frees);
+    free_block(stats, sizeof(alloc_stats_t));
+}
+
+/* Report statistics of the test allocator */
+static bool do_memstats(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    report_memstats();
+    return true;
+}
+
+static void set_poison_mode(int oldval)
+{
+    if (poison_mode < 0 || poison_mode >= N_POISON) {
+        report(1, "Unknown poison mode %d, keeping %s", poison_mode,
+               poison_names[oldval]);
+        poison_mode = oldval;
+    }
+}
+
+static void set_cmd_stats(int oldval)
+{
+    cmd_started = false;
+    set_cmd_hook(cmd_stats_on ? cmd_memstats : NULL);
+}
+
+static void set_guard_rate(int oldval)
+{
+    if (guard_rate < 0) {
+        report(1, "Guard rate must not be negative, keeping %d", oldval);
+        guard_rate = oldval;
+    }
+}
+
+static void set_fail_probability(int oldval)
+{
+    if (fail_probability < 0 || fail_probability > 100) {
+        report(1, "Malloc failure probability must be between 0 and 100, "
+                  "keeping %d",
+               oldval);
+        fail_probability = oldval;
+    }
+    reset_fail_schedule();
+}
+
+static void set_fail_every(int oldval)
+{
+    if (fail_every < 0) {
+        report(1, "Allocation failure interval must not be negative, keeping "
+                  "%d",
+               oldval);
+        fail_every = oldval;
+    }
+    reset_fail_schedule();
+}
+
+static void set_fail_after(int oldval)
+{
+    if (fail_after < 0) {
+        report(1, "Allocation byte limit must not be negative, keeping %d",
+               oldval);
+        fail_after = oldval;
+    }
+    reset_fail_schedule();
+}
+
+static void set_fail_seed(int oldval)
+{
+    reset_fail_schedule();
+}
+
+static void set_alloc_backend(int oldval)
+{
+    if (alloc_backend < 0 || alloc_backend >= N_ALLOC) {
+        report(1, "Unknown allocator %d, keeping %s", alloc_backend,
+               alloc_names[oldval]);
+        alloc_backend = oldval;
+    }
+}
+
+static void set_queue_layout(int oldval)
+{
+    if (queue_layout < 0 || queue_layout >= N_LAYOUT) {
+        report(1, "Unknown layout %d, keeping %s", queue_layout,
+               layout_names[oldval]);
+        queue_layout = oldval;
+    }
+}
+
+static void set_sort_alg(int oldval)
+{
+    if (sort_alg < 0 || sort_alg >= N_SORT) {
+        report(1, "Unknown sorting engine %d, keeping %s", sort_alg,
+               sort_names[oldval]);
+        sort_alg = oldval;
+    }
+}
+
+static void set_merge_alg(int oldval)
+{
+    if (merge_alg < 0 || merge_alg >= N_MERGE) {
+        report(1, "Unknown merge strategy %d, keeping %s", merge_alg,
+               merge_names[oldval]);
+        merge_alg = oldval;
+    }
+}
+
+static void set_sort_threads(int oldval)
+{
+    if (sort_threads < 1 || sort_threads > TPOOL_MAX_WORKERS + 1) {
+        report(1, "Number of threads must be between 1 and %d, keeping %d",
+               TPOOL_MAX_WORKERS + 1, oldval);
+        sort_threads = oldval;
+    }
+    if (!tpool_resize(sort_threads - 1)) {
+        report(1, "ERROR: Could not start %d worker threads, keeping %d",
+               sort_threads - 1, oldval);
+        sort_threads = oldval;
+        tpool_resize(sort_threads - 1);
+    }
+}
+
+static void set_key_prefix(int oldval)
+{
+    if (key_prefix != 0 && key_prefix != 1) {
+        report(1, "Prefix keys must be enabled with 1 or disabled with 0, "
+                  "keeping %d",
+               oldval);
+        key_prefix = oldval;
+    }
+}
+
 static void console_init()
 {
-    ADD_COMMAND(new, "Create new queue", "");
+    ADD_COMMAND(new,
+                "Create new queue, kept as a linked list or an array "
+                "(default: option layout)",
+                "[list|array]");
     ADD_COMMAND(free, "Delete queue", "");
     ADD_COMMAND(prev, "Switch to previous queue", "");
     ADD_COMMAND(next, "Switch to next queue", "");
@@ -1017,6 +2058,8 @@ static void console_init()
         rt,
         "Remove from tail of queue. Optionally compare to expected value str",
         "[str]");
+    ADD_COMMAND(rhn, "Remove n elements from head of queue at once", "n");
+    ADD_COMMAND(rtn, "Remove n elements from tail of queue at once", "n");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
@@ -1031,13 +2074,67 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(sortbench,
+                "Sort random, sorted, reversed and duplicate-heavy inputs with "
+                "every sorting engine, with and without prefix keys, at sizes "
+                "min, 10*min, ... up to max and report comparisons, time, "
+                "cycles and cache misses (default: 1000 to 1000000, max == "
+                "min if only min is given)",
+                "[min [max]]");
+    ADD_COMMAND(mpmc,
+                "Run producer and consumer threads against a lock-free ring "
+                "or list queue and report throughput and operation latency "
+                "(default: 2 producers, 2 consumers, 100000 elements each)",
+                "ring|list [producers [consumers [n]]]");
+    ADD_COMMAND(stress,
+                "Run producer and consumer threads against a shared ring, "
+                "list or mutex-protected queue for msec milliseconds and "
+                "report throughput, contention and latency percentiles "
+                "(default: 2 producers, 2 consumers, 1000 msec)",
+                "ring|list|mutex [producers [consumers [msec]]]");
+    ADD_COMMAND(memstats, "Show statistics of the test allocator", "");
     // ADD_COMMAND(shuffle, "Do Fisher-Yates shuffle", "");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
-              NULL);
+              set_fail_probability);
+    add_enum_param("poison", &poison_mode, poison_names,
+                   "Poisoning of allocated and freed payloads "
+                   "(full|header|off)",
+                   set_poison_mode);
+    add_param("exitstats", &exit_stats,
+              "Show allocator statistics at exit (memstats)", NULL);
+    add_param("cmdstats", &cmd_stats_on,
+              "Count allocations and frees of every command (memstats)",
+              set_cmd_stats);
+    add_param("guard", &guard_rate,
+              "Place 1 in N allocations against a guard page (0: never)",
+              set_guard_rate);
+    add_param("failevery", &fail_every, "Fail every Nth allocation (0: never)",
+              set_fail_every);
+    add_param("failafter", &fail_after,
+              "Fail allocations beyond this many bytes (0: never)",
+              set_fail_after);
+    add_param("failseed", &fail_seed,
+              "Seed of random allocation failures (0: random seed)",
+              set_fail_seed);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_enum_param("alloc", &alloc_backend, alloc_names,
+                   "Element allocator of new queues (malloc|pool)",
+                   set_alloc_backend);
+    add_enum_param("layout", &queue_layout, layout_names,
+                   "Layout of new queues (list|array)", set_queue_layout);
+    add_enum_param("sortalg", &sort_alg, sort_names,
+                   "Sorting engine behind q_sort (merge|listsort|radix)",
+                   set_sort_alg);
+    add_enum_param("mergealg", &merge_alg, merge_names,
+                   "Strategy behind q_merge (pairwise|heap)", set_merge_alg);
+    add_param("threads", &sort_threads, "Number of threads used by q_sort",
+              set_sort_threads);
+    add_param("prefix", &key_prefix,
+              "Compare elements by 8-byte prefix keys before their strings",
+              set_key_prefix);
 }
 
 /* Signal handlers */
@@ -1071,8 +2168,6 @@ static bool q_quit(int argc, char *argv[])
 {
     return true;
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1087,7 +2182,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1239,6 +2333,8 @@ int main(int argc, char *argv[])
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
+    if (exit_stats)
+        report_memstats();
 
     return !ok;
 }
@@ -1,9 +1,11 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
 #include "queue.h"
+#include "tpool.h"
 
 /* Notice: sometimes, Cppcheck would find the potential NULL pointer bugs,
  * but some of them cannot occur. You can suppress them by adding the
@@ -11,34 +13,147 @@
  *   cppcheck-suppress nullPointer
  */
 
+/* Get the queue_head_t owning a list head returned by q_new() */
+#define to_queue(h) list_entry(h, queue_head_t, head)
+
+int key_prefix = 0;
+
+int queue_layout = LAYOUT_LIST;
+
+/* Does the queue keep its elements in an array? */
+static inline bool is_array(struct list_head *head)
+{
+    return to_queue(head)->layout == LAYOUT_ARRAY;
+}
+
+/* Compare the strings of two elements like strcmp(). With key_prefix set,
+ * most comparisons are settled by the keys without touching the strings.
+ */
+static inline int element_cmp(const element_t *a, const element_t *b)
+{
+    if (!key_prefix)
+        return strcmp(a->value, b->value);
+    if (a->key != b->key)
+        return a->key < b->key ? -1 : 1;
+    /* Equal keys with a NUL in them mean both strings end in the prefix */
+    if (!(a->key & 0xff))
+        return 0;
+    return strcmp(a->value + 8, b->value + 8);
+}
+
+/* Do two elements hold the same string? Strings of different length never
+ * do, so most distinct neighbours are told apart without reading them.
+ */
+static inline bool element_equal(const element_t *a, const element_t *b)
+{
+    return a->len == b->len && a->key == b->key &&
+           !memcmp(a->value, b->value, a->len);
+}
 
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
-    if (head == NULL)
+    queue_head_t *q = malloc(sizeof(queue_head_t));
+    if (q == NULL)
         return NULL;
-    INIT_LIST_HEAD(head);
-    return head;
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->pool = NULL;
+    q->layout = queue_layout;
+    deque_init(&q->deque);
+    if (alloc_backend == ALLOC_POOL) {
+        q->pool = pool_new();
+        if (q->pool == NULL) {
+            free(q);
+            return NULL;
+        }
+    }
+    return &q->head;
 }
 
 /* Free all storage used by queue */
 
 void q_free(struct list_head *l)
 {
-    if (l == NULL || list_empty(l)) {
-        free(l);
+    if (l == NULL)
         return;
+    queue_head_t *q = to_queue(l);
+    if (is_array(l)) {
+        element_t *node;
+        while ((node = deque_pop_head(&q->deque)))
+            q_release_element(node);
     }
+    /* Queues left linked by q_merge() may still hold an array */
+    deque_destroy(&q->deque);
     struct list_head *next = l->next;
-    while (l != next) {
+    while (!is_array(l) && l != next) {
         list_del(next);
         element_t *node = list_entry(next, element_t, list);
         next = next->next;
-        free(node->value);
-        free(node);
+        q_release_element(node);
+    }
+    if (q->pool)
+        pool_put(q->pool);
+    free(q);
+}
+
+/* Allocate an element holding a copy of s from pool, or with malloc */
+element_t *q_new_element(pool_t *pool, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    bool inline_value = len <= ELEMENT_INLINE_LEN + 1;
+    element_t *node;
+    if (pool == NULL) {
+        node = aligned_alloc(ELEMENT_ALIGN,
+                             sizeof(element_t) + (inline_value ? len : 0));
+        if (node == NULL)
+            return NULL;
+        node->value = inline_value ? (char *) (node + 1) : malloc(len);
+        if (node->value == NULL) {
+            free(node);
+            return NULL;
+        }
+        memcpy(node->value, s, len);
+        node->pool = NULL;
+        node->key = q_prefix_key(s);
+        node->len = len - 1;
+        node->flags = inline_value ? ELEMENT_INLINE : 0;
+        return node;
+    }
+
+    if (inline_value) {
+        node = pool_alloc(pool, sizeof(element_t) + len);
+        if (node == NULL)
+            return NULL;
+        node->value = (char *) (node + 1);
+    } else {
+        node = pool_alloc(pool, sizeof(element_t));
+        if (node == NULL)
+            return NULL;
+        node->value = pool_alloc(pool, len);
+        if (node->value == NULL) {
+            pool_free(pool, node, sizeof(element_t));
+            return NULL;
+        }
     }
-    free(l);
+    memcpy(node->value, s, len);
+    node->pool = pool;
+    node->key = q_prefix_key(s);
+    node->len = len - 1;
+    node->flags = inline_value ? ELEMENT_INLINE : 0;
+    return node;
+}
+
+/* Return a pooled element and its string to the pool */
+void q_release_pooled(element_t *e)
+{
+    size_t len = e->len + 1;
+    if (q_value_inline(e)) {
+        pool_free(e->pool, e, sizeof(element_t) + len);
+        return;
+    }
+    pool_free(e->pool, e->value, len);
+    pool_free(e->pool, e, sizeof(element_t));
 }
 
 /* Insert an element at head of queue */
@@ -46,15 +161,16 @@ bool q_insert_head(struct list_head *head, char *s)
 {
     if (head == NULL)
         return false;
-    element_t *node = malloc(sizeof(element_t));
+    element_t *node = q_new_element(to_queue(head)->pool, s);
     if (node == NULL)
         return false;
-    node->value = strdup(s);
-    if (node->value == NULL) {
-        free(node);
+    if (!is_array(head)) {
+        list_add(&node->list, head);
+    } else if (!deque_push_head(&to_queue(head)->deque, node)) {
+        q_release_element(node);
         return false;
     }
-    list_add(&node->list, head);
+    to_queue(head)->size++;
     return true;
 }
 
@@ -63,73 +179,330 @@ bool q_insert_tail(struct list_head *head, char *s)
 {
     if (head == NULL)
         return false;
-    element_t *node = malloc(sizeof(element_t));
+    element_t *node = q_new_element(to_queue(head)->pool, s);
     if (node == NULL)
         return false;
-    node->value = strdup(s);
-    if (node->value == NULL) {
-        free(node);
+    if (!is_array(head)) {
+        list_add_tail(&node->list, head);
+    } else if (!deque_push_tail(&to_queue(head)->deque, node)) {
+        q_release_element(node);
         return false;
     }
-    list_add_tail(&node->list, head);
+    to_queue(head)->size++;
     return true;
 }
 
+/* Allocate elements for the n strings of sv into the private list batch, in
+ * the order q_insert_head() or q_insert_tail() would leave them
+ */
+static bool q_new_batch(struct list_head *head,
+                        struct list_head *batch,
+                        char **sv,
+                        int n,
+                        bool at_tail)
+{
+    pool_t *pool = to_queue(head)->pool;
+    INIT_LIST_HEAD(batch);
+    for (int i = 0; i < n; i++) {
+        element_t *node = q_new_element(pool, sv[i]);
+        if (node == NULL) {
+            element_t *e, *safe;
+            list_for_each_entry_safe (e, safe, batch, list)
+                q_release_element(e);
+            return false;
+        }
+        if (at_tail)
+            list_add_tail(&node->list, batch);
+        else
+            list_add(&node->list, batch);
+    }
+    return true;
+}
+
+/* Move the elements of the private list batch to either end of the array
+ * of the queue at head, keeping their order. Room has been reserved.
+ */
+static void array_splice(struct list_head *head,
+                         struct list_head *batch,
+                         bool at_tail)
+{
+    deque_t *d = &to_queue(head)->deque;
+    if (at_tail) {
+        element_t *e;
+        list_for_each_entry (e, batch, list)
+            deque_push_tail(d, e);
+    } else {
+        for (struct list_head *l = batch->prev; l != batch; l = l->prev)
+            deque_push_head(d, list_entry(l, element_t, list));
+    }
+}
+
+/* Insert n elements at head of queue */
+bool q_insert_head_bulk(struct list_head *head, char **sv, int n)
+{
+    struct list_head batch;
+    if (head == NULL || n < 0)
+        return false;
+    if (is_array(head) && !deque_reserve(&to_queue(head)->deque, n))
+        return false;
+    if (!q_new_batch(head, &batch, sv, n, false))
+        return false;
+    if (is_array(head))
+        array_splice(head, &batch, false);
+    else
+        list_splice(&batch, head);
+    to_queue(head)->size += n;
+    return true;
+}
+
+/* Insert n elements at tail of queue */
+bool q_insert_tail_bulk(struct list_head *head, char **sv, int n)
+{
+    struct list_head batch;
+    if (head == NULL || n < 0)
+        return false;
+    if (is_array(head) && !deque_reserve(&to_queue(head)->deque, n))
+        return false;
+    if (!q_new_batch(head, &batch, sv, n, true))
+        return false;
+    if (is_array(head))
+        array_splice(head, &batch, true);
+    else
+        list_splice_tail(&batch, head);
+    to_queue(head)->size += n;
+    return true;
+}
+
+/* Copy the string of e into sp, truncated to bufsize - 1 characters */
+static inline void q_copy_value(const element_t *e, char *sp, size_t bufsize)
+{
+    size_t len = e->len < bufsize - 1 ? e->len : bufsize - 1;
+    memcpy(sp, e->value, len);
+    sp[len] = '\0';
+}
+
 /* Remove an element from head of queue */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head)) {
+    if (!head || !q_size(head)) {
         return NULL;
     }
 
-    element_t *target = list_first_entry(head, element_t, list);
-    list_del(&target->list);
-
-    if (sp) {
-        size_t len = strlen(target->value) + 1;
-        len = (bufsize - 1) > len ? len : (bufsize - 1);
-        // memcpy(sp, target->value, len);
-        strncpy(sp, target->value, len);
-        sp[len] = '\0';
+    element_t *target;
+    if (is_array(head)) {
+        target = deque_pop_head(&to_queue(head)->deque);
+    } else {
+        target = list_first_entry(head, element_t, list);
+        list_del(&target->list);
     }
+    to_queue(head)->size--;
+
+    if (sp)
+        q_copy_value(target, sp, bufsize);
     return target;
 }
 
 /* Remove an element from tail of queue */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (head == NULL || list_empty(head))
+    if (head == NULL || !q_size(head))
         return NULL;
-    element_t *node = list_entry(head->prev, element_t, list);
-    list_del(head->prev);
-    if (sp != NULL) {
-        size_t len = strlen(node->value) + 1;
-        len = (bufsize - 1) > len ? len : (bufsize - 1);
-        // memcpy(sp, target->value, len);
-        strncpy(sp, node->value, len);
-        sp[len] = '\0';
+    element_t *node;
+    if (is_array(head)) {
+        node = deque_pop_tail(&to_queue(head)->deque);
+    } else {
+        node = list_entry(head->prev, element_t, list);
+        list_del(head->prev);
     }
+    to_queue(head)->size--;
+    if (sp != NULL)
+        q_copy_value(node, sp, bufsize);
     return node;
 }
 
-/* Return number of elements in queue */
-int q_size(struct list_head *head)
+/* Release the elements of the private list batch, walking it backwards if
+ * reverse is set, after copying their strings into buf while they fit.
+ * Return the number of strings copied.
+ */
+static int q_drain(struct list_head *batch,
+                   bool reverse,
+                   char *buf,
+                   size_t bufsize)
+{
+    int copied = 0;
+    struct list_head *node = reverse ? batch->prev : batch->next;
+    while (node != batch) {
+        struct list_head *next = reverse ? node->prev : node->next;
+        element_t *e = list_entry(node, element_t, list);
+        if (buf) {
+            size_t len = e->len + 1;
+            if (len <= bufsize) {
+                memcpy(buf, e->value, len);
+                buf += len;
+                bufsize -= len;
+                copied++;
+            } else {
+                buf = NULL;
+            }
+        }
+        q_release_element(e);
+        node = next;
+    }
+    return copied;
+}
+
+/* Move up to n elements from either end of the array of the queue at head
+ * to the private list batch, in the order they are removed. Return how
+ * many were moved.
+ */
+static int array_cut(struct list_head *head,
+                     int n,
+                     struct list_head *batch,
+                     bool at_tail)
+{
+    deque_t *d = &to_queue(head)->deque;
+    if (n > q_size(head))
+        n = q_size(head);
+    for (int i = 0; i < n; i++) {
+        element_t *e = at_tail ? deque_pop_tail(d) : deque_pop_head(d);
+        list_add_tail(&e->list, batch);
+    }
+    return n;
+}
+
+/* Remove up to n elements from head of queue */
+int q_remove_head_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    int *copied)
+{
+    if (copied)
+        *copied = 0;
+    if (!head || n <= 0 || !q_size(head))
+        return 0;
+
+    struct list_head batch;
+    INIT_LIST_HEAD(&batch);
+    if (is_array(head)) {
+        n = array_cut(head, n, &batch, false);
+    } else if (n >= q_size(head)) {
+        n = q_size(head);
+        list_splice_init(head, &batch);
+    } else {
+        struct list_head *last = head;
+        for (int i = 0; i < n; i++)
+            last = last->next;
+        list_cut_position(&batch, head, last);
+    }
+    to_queue(head)->size -= n;
+    int c = q_drain(&batch, false, buf, bufsize);
+    if (copied)
+        *copied = c;
+    return n;
+}
+
+/* Remove up to n elements from tail of queue */
+int q_remove_tail_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    int *copied)
 {
-    if (head == NULL || list_empty(head))
+    if (copied)
+        *copied = 0;
+    if (!head || n <= 0 || !q_size(head))
         return 0;
+
+    /* The cut of an array comes out tail first already */
+    bool reverse = !is_array(head);
+    struct list_head batch;
+    INIT_LIST_HEAD(&batch);
+    if (is_array(head)) {
+        n = array_cut(head, n, &batch, true);
+    } else if (n >= q_size(head)) {
+        n = q_size(head);
+        list_splice_init(head, &batch);
+    } else {
+        struct list_head *first = head, keep;
+        for (int i = 0; i < n; i++)
+            first = first->prev;
+        /* Cut the front off, take what is left, then put the front back */
+        list_cut_position(&keep, head, first->prev);
+        list_splice_init(head, &batch);
+        list_splice(&keep, head);
+    }
+    to_queue(head)->size -= n;
+    int c = q_drain(&batch, reverse, buf, bufsize);
+    if (copied)
+        *copied = c;
+    return n;
+}
+
+#ifdef QUEUE_DEBUG
+/* Cross-check the cached element count against a walk of the list */
+static void q_verify_size(struct list_head *head)
+{
     int size = 0;
     struct list_head *l;
-    list_for_each (l, head)
-        size++;
-    return size;
+    if (is_array(head))
+        size = to_queue(head)->deque.count;
+    else
+        list_for_each (l, head)
+            size++;
+    assert(size == to_queue(head)->size);
+}
+#endif
+
+/* Link the elements of an array-backed queue in order */
+void q_links(struct list_head *head)
+{
+    if (!head || !is_array(head))
+        return;
+    deque_t *d = &to_queue(head)->deque;
+    INIT_LIST_HEAD(head);
+    for (size_t i = 0; i < d->count; i++)
+        list_add_tail(&((element_t *) *deque_at(d, i))->list, head);
+}
+
+/* Look at the element i positions in from either end */
+element_t *q_peek(struct list_head *head, bool at_tail, int i)
+{
+    if (!head || i < 0 || i >= q_size(head))
+        return NULL;
+    if (is_array(head)) {
+        deque_t *d = &to_queue(head)->deque;
+        return *deque_at(d, at_tail ? d->count - 1 - i : (size_t) i);
+    }
+    struct list_head *l = at_tail ? head->prev : head->next;
+    while (i--)
+        l = at_tail ? l->prev : l->next;
+    return list_entry(l, element_t, list);
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (head == NULL)
+        return 0;
+#ifdef QUEUE_DEBUG
+    q_verify_size(head);
+#endif
+    return to_queue(head)->size;
 }
 
 /* Delete the middle node in queue */
 bool q_delete_mid(struct list_head *head)
 {
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
-    if (head == NULL || list_empty(head))
+    if (head == NULL || !q_size(head))
         return false;
+    if (is_array(head)) {
+        deque_t *d = &to_queue(head)->deque;
+        q_release_element(deque_erase(d, (d->count - 1) / 2));
+        to_queue(head)->size--;
+        return true;
+    }
     struct list_head *first = head->next;
     struct list_head *second = head->prev;
     while ((first != second) && (first->next != second)) {
@@ -137,30 +510,59 @@ bool q_delete_mid(struct list_head *head)
         second = second->prev;
     }
     list_del(first);
-    element_t *node = list_entry(first, element_t, list);
-    free(node->value);
-    free(node);
+    to_queue(head)->size--;
+    q_release_element(list_entry(first, element_t, list));
     return true;
 }
 
+/* Release every element of a run of equal neighbours, compacting the
+ * survivors towards the head of the array
+ */
+static void array_delete_dup(struct list_head *head)
+{
+    deque_t *d = &to_queue(head)->deque;
+    size_t kept = 0;
+    for (size_t i = 0; i < d->count;) {
+        element_t *e = *deque_at(d, i);
+        size_t j = i + 1;
+        while (j < d->count && element_equal(e, *deque_at(d, j)))
+            j++;
+        if (j - i == 1) {
+            *deque_at(d, kept++) = e;
+        } else {
+            for (size_t k = i; k < j; k++)
+                q_release_element(*deque_at(d, k));
+        }
+        i = j;
+    }
+    to_queue(head)->size = kept;
+    deque_drop_tail(d, d->count - kept);
+}
+
 /* Delete all nodes that have duplicate string */
 bool q_delete_dup(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
     if (!head)
         return false;
+    if (is_array(head)) {
+        array_delete_dup(head);
+        return true;
+    }
 
     element_t *first;
     element_t *second;
     bool isdup = false;
     list_for_each_entry_safe (first, second, head, list) {
-        if (&second->list != head && !strcmp(first->value, second->value)) {
+        if (&second->list != head && element_equal(first, second)) {
             list_del(&first->list);
             q_release_element(first);
+            to_queue(head)->size--;
             isdup = true;
         } else if (isdup) {
             list_del(&first->list);
             q_release_element(first);
+            to_queue(head)->size--;
             isdup = false;
         }
     }
@@ -171,8 +573,14 @@ bool q_delete_dup(struct list_head *head)
 void q_swap(struct list_head *head)
 {
     // https://leetcode.com/problems/swap-nodes-in-pairs/
-    if (head == NULL || list_empty(head))
+    if (head == NULL || !q_size(head))
         return;
+    if (is_array(head)) {
+        deque_t *d = &to_queue(head)->deque;
+        for (size_t i = 0; i + 1 < d->count; i += 2)
+            deque_reverse(d, i, 2);
+        return;
+    }
     struct list_head *first = head->next;
     struct list_head *second = head->next->next;
     while (first != head && second != head) {
@@ -188,10 +596,10 @@ void q_swap(struct list_head *head)
     }
 }
 
-/* Reverse elements in queue */
-void q_reverse(struct list_head *head)
+/* Reverse a list, which need not be the list of a queue */
+static void list_reverse(struct list_head *head)
 {
-    if (head == NULL || list_empty(head))
+    if (list_empty(head))
         return;
     struct list_head *first = head;
     struct list_head *second = head->next;
@@ -204,8 +612,21 @@ void q_reverse(struct list_head *head)
     } while (first != head);
 }
 
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (head == NULL || !q_size(head))
+        return;
+    if (is_array(head)) {
+        deque_reverse(&to_queue(head)->deque, 0, q_size(head));
+        return;
+    }
+    list_reverse(head);
+}
+
 void print(struct list_head *head)
 {
+    q_links(head);
     struct list_head *tmp = head->next;
     while (tmp != head) {
         element_t *node = list_entry(tmp, element_t, list);
@@ -221,6 +642,12 @@ void q_reverseK(struct list_head *head, int k)
     // https://leetcode.com/problems/reverse-nodes-in-k-group/
     if (!head)
         return;
+    if (is_array(head)) {
+        deque_t *d = &to_queue(head)->deque;
+        for (size_t i = 0; k > 0 && i + k <= d->count; i += k)
+            deque_reverse(d, i, k);
+        return;
+    }
 
     struct list_head *last = head->next;
     int times = q_size(head) / k;
@@ -231,12 +658,35 @@ void q_reverseK(struct list_head *head, int k)
         for (int j = 0; j < k; ++j)
             last = last->next;
         list_cut_position(&tmp, head, last->prev);
-        q_reverse(&tmp);
+        list_reverse(&tmp);
         list_splice_tail_init(&tmp, &result);
     }
     list_splice_init(&result, head);
 }
 
+int sort_alg = SORT_MERGE;
+
+int sort_threads = 1;
+
+size_t q_sort_compares = 0;
+
+/* Comparisons made by the calling thread during the current sort */
+static __thread size_t thread_compares;
+
+/* Compare two strings on behalf of q_sort(), counting the comparison */
+static inline int sort_strcmp(const char *a, const char *b)
+{
+    thread_compares++;
+    return strcmp(a, b);
+}
+
+/* Compare two elements on behalf of q_sort(), counting the comparison */
+static inline int sort_cmp(const element_t *a, const element_t *b)
+{
+    thread_compares++;
+    return element_cmp(a, b);
+}
+
 struct list_head *mergelist(struct list_head *l1, struct list_head *l2)
 {
     struct list_head *head = NULL;
@@ -244,7 +694,7 @@ struct list_head *mergelist(struct list_head *l1, struct list_head *l2)
     while (l1 && l2) {
         element_t *e1 = list_entry(l1, element_t, list);
         element_t *e2 = list_entry(l2, element_t, list);
-        if (strcmp(e1->value, e2->value) >= 0) {
+        if (sort_cmp(e1, e2) > 0) {
             *cur = l2;
             l2 = l2->next;
         } else {
@@ -278,19 +728,16 @@ struct list_head *mergesort(struct list_head *l)
     return mergelist(mergesort(l1), mergesort(l2));
 }
 
-// Sort elements of queue in ascending order
-void q_sort(struct list_head *head)
+/* Rebuild prev links of the NULL-terminated list starting at first and link
+ * it back into head as a circular doubly-linked list
+ */
+static void relink(struct list_head *head, struct list_head *first)
 {
-    if (head == NULL || list_empty(head))
-        return;
-    head->prev->next = NULL;
-    head->next->prev = head->prev;
-    head->next = mergesort(head->next);
-
     struct list_head *cur = head;
-    struct list_head *next = head->next;
+    struct list_head *next = first;
     while (next) {
         next->prev = cur;
+        cur->next = next;
         cur = next;
         next = next->next;
     }
@@ -298,21 +745,159 @@ void q_sort(struct list_head *head)
     head->prev = cur;
 }
 
+/* Lists no longer than this are finished by insertion sort in radix_sort() */
+#define RADIX_CUTOFF 16
+
+/* Byte depth of the string of e, taken from the key while it covers it */
+static inline unsigned char radix_byte(const element_t *e, size_t depth)
+{
+    if (key_prefix && depth < 8)
+        return (unsigned char) (e->key >> (56 - 8 * depth));
+    return (unsigned char) e->value[depth];
+}
+
+/* Insertion sort of the NULL-terminated list l on the strings from byte depth
+ * on. Return the new first node and store the last one at *tailp.
+ */
+static struct list_head *radix_insertion_sort(struct list_head *l,
+                                              size_t depth,
+                                              struct list_head **tailp)
+{
+    struct list_head *sorted = NULL;
+    while (l) {
+        struct list_head *node = l;
+        const char *s = list_entry(node, element_t, list)->value + depth;
+        l = l->next;
+
+        /* Insert after every node that is not greater, to keep it stable */
+        struct list_head **pos = &sorted;
+        while (*pos &&
+               sort_strcmp(list_entry(*pos, element_t, list)->value + depth,
+                           s) <= 0)
+            pos = &(*pos)->next;
+        node->next = *pos;
+        *pos = node;
+    }
+
+    struct list_head *tail = sorted;
+    while (tail->next)
+        tail = tail->next;
+    *tailp = tail;
+    return sorted;
+}
+
+/* Buckets of one distribution pass of radix_sort(). A pass is over before
+ * the sort recurses, so every level shares them and only a few words of
+ * state stay on the stack per level, which matters on worker threads.
+ */
+static __thread struct list_head *radix_heads[256], **radix_tails[256];
+static __thread size_t radix_counts[256];
+
+/* Most-significant-digit radix sort of the NULL-terminated list l holding n
+ * nodes whose strings share their first depth bytes.
+ * Nodes are distributed into one bucket per byte value, so no per-node
+ * storage is needed. The buckets are then chained back in order, and each
+ * run of equal bytes along the chain is sorted on the next byte. Return the
+ * new first node and store the last one at *tailp.
+ */
+static struct list_head *radix_sort(struct list_head *l,
+                                    size_t n,
+                                    size_t depth,
+                                    struct list_head **tailp)
+{
+    struct list_head **heads = radix_heads, ***tails = radix_tails;
+    size_t *counts = radix_counts;
+
+    while (n > RADIX_CUTOFF) {
+        memset(counts, 0, sizeof(radix_counts));
+        for (int c = 0; c < 256; c++)
+            tails[c] = &heads[c];
+
+        int last = 0;
+        for (struct list_head *node = l; node; node = node->next) {
+            element_t *e = list_entry(node, element_t, list);
+            unsigned char c = radix_byte(e, depth);
+            *tails[c] = node;
+            tails[c] = &node->next;
+            counts[c]++;
+            last = c;
+        }
+
+        /* All strings share the next byte too, go on without recursing */
+        if (counts[last] == n) {
+            *tails[last] = NULL;
+            if (last == 0) {
+                *tailp = list_entry(tails[0], struct list_head, next);
+                return heads[0];
+            }
+            l = heads[last];
+            depth++;
+            continue;
+        }
+
+        /* Chain the buckets in order, strings ending here first */
+        struct list_head *chain = NULL, **link = &chain;
+        for (int c = 0; c < 256; c++) {
+            if (!counts[c])
+                continue;
+            *link = heads[c];
+            link = tails[c];
+        }
+        *link = NULL;
+
+        /* Sort each run of equal bytes on the next one, leaving strings that
+         * end here in their original order
+         */
+        struct list_head *first = NULL, *tail = NULL;
+        link = &first;
+        while (chain) {
+            unsigned char c =
+                radix_byte(list_entry(chain, element_t, list), depth);
+            struct list_head *end = chain;
+            size_t k = 1;
+            while (end->next &&
+                   radix_byte(list_entry(end->next, element_t, list),
+                              depth) == c) {
+                end = end->next;
+                k++;
+            }
+            struct list_head *run = chain;
+            chain = end->next;
+            end->next = NULL;
+            if (c) {
+                *link = radix_sort(run, k, depth + 1, &tail);
+            } else {
+                *link = run;
+                tail = end;
+            }
+            link = &tail->next;
+        }
+        *tailp = tail;
+        return first;
+    }
+    return radix_insertion_sort(l, depth, tailp);
+}
+
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
 typedef uint8_t u8;
 
-typedef int __attribute__((nonnull(2, 3))) (*list_cmp_func_t)();
+typedef int __attribute__((nonnull(2, 3))) (*list_cmp_func_t)(
+    void *,
+    const struct list_head *,
+    const struct list_head *);
 
 /*
  * Compare function of merge of list_sort
  */
-int compare(void *priv, struct list_head *a, struct list_head *b)
+static int compare(void *priv,
+                   const struct list_head *a,
+                   const struct list_head *b)
 {
-    element_t *ele_a = list_entry(a, element_t, list);
-    element_t *ele_b = list_entry(b, element_t, list);
-    return strcmp(ele_a->value, ele_b->value);
+    const element_t *ele_a = list_entry(a, element_t, list);
+    const element_t *ele_b = list_entry(b, element_t, list);
+    return sort_cmp(ele_a, ele_b);
 }
 
 /*
@@ -408,9 +993,15 @@ __attribute__((nonnull(2, 3, 4, 5))) static void merge_final(
     head->prev = tail;
 }
 
-__attribute__((nonnull(2, 3))) void list_sort(void *priv,
-                                              struct list_head *head,
-                                              list_cmp_func_t cmp)
+/*
+ * Port of lib/list_sort.c from the Linux kernel: a bottom-up merge sort that
+ * keeps pending sublists in power-of-two sizes and merges them 2:1 as soon as
+ * that is cache friendly, so it never has to walk the list to find a
+ * midpoint. Stable, and needs no storage beyond the list itself.
+ */
+__attribute__((nonnull(2, 3))) static void list_sort(void *priv,
+                                                     struct list_head *head,
+                                                     list_cmp_func_t cmp)
 {
     struct list_head *list = head->next, *pending = NULL;
     size_t count = 0; /* Count of pending */
@@ -454,11 +1045,115 @@ __attribute__((nonnull(2, 3))) void list_sort(void *priv,
 
         if (!next)
             break;
-        list = merge(NULL, cmp, pending, list);
+        list = merge(priv, cmp, pending, list);
         pending = next;
     }
     /* The final merge, rebuilding prev links */
-    merge_final(NULL, cmp, head, pending, list);
+    merge_final(priv, cmp, head, pending, list);
+}
+
+/* Sort the non-empty list at head holding n nodes with the selected engine */
+static void sort_list(struct list_head *head, size_t n)
+{
+    switch (sort_alg) {
+    case SORT_LISTSORT:
+        list_sort(NULL, head, compare);
+        break;
+    case SORT_RADIX: {
+        struct list_head *tail;
+        head->prev->next = NULL;
+        relink(head, radix_sort(head->next, n, 0, &tail));
+        break;
+    }
+    default:
+        head->prev->next = NULL;
+        head->next->prev = head->prev;
+        relink(head, mergesort(head->next));
+        break;
+    }
+}
+
+/* Smallest run worth handing to a thread of its own */
+#define SORT_MIN_RUN 4096
+
+/* Runs sorted concurrently by q_sort() */
+typedef struct {
+    struct list_head head;
+    size_t n;
+} sort_run_t;
+
+static void merge_runs(sort_run_t *runs, int n_runs, struct list_head *result);
+
+static void sort_run_task(void *arg, int idx)
+{
+    sort_run_t *run = (sort_run_t *) arg + idx;
+    thread_compares = 0;
+    sort_list(&run->head, run->n);
+    __atomic_fetch_add(&q_sort_compares, thread_compares, __ATOMIC_RELAXED);
+}
+
+/* Runs of the parallel sort. Static rather than on the stack, since workers
+ * may still be sorting them when the time limit jumps out of q_sort().
+ */
+static sort_run_t sort_runs[TPOOL_MAX_WORKERS + 1];
+
+/* Cut the list into one run per thread, sort the runs concurrently and merge
+ * them back. No allocation is made, since do_sort forbids it.
+ */
+static void sort_parallel(struct list_head *head, size_t n, int n_runs)
+{
+    for (int i = 0; i < n_runs; i++) {
+        size_t len = n * (i + 1) / n_runs - n * i / n_runs;
+        struct list_head *last = head;
+        for (size_t j = 0; j < len; j++)
+            last = last->next;
+        INIT_LIST_HEAD(&sort_runs[i].head);
+        list_cut_position(&sort_runs[i].head, head, last);
+        sort_runs[i].n = len;
+    }
+
+    tpool_run(sort_run_task, sort_runs, n_runs);
+
+    thread_compares = 0;
+    merge_runs(sort_runs, n_runs, head);
+    q_sort_compares += thread_compares;
+}
+
+/* Store the elements of an array-backed queue in the order of its list
+ * links, which hold the same elements as its array
+ */
+static void array_store_links(struct list_head *head)
+{
+    deque_t *d = &to_queue(head)->deque;
+    size_t i = 0;
+    element_t *e;
+    list_for_each_entry (e, head, list)
+        *deque_at(d, i++) = e;
+}
+
+/* Sort elements of queue in ascending order */
+void q_sort(struct list_head *head)
+{
+    if (head == NULL || !q_size(head))
+        return;
+
+    /* Array-backed queues are sorted through their list links, so that they
+     * get the same engines and stability as linked ones without allocating
+     */
+    q_links(head);
+    size_t n = q_size(head);
+    int n_runs = sort_threads;
+    if ((size_t) n_runs > n / SORT_MIN_RUN)
+        n_runs = n / SORT_MIN_RUN;
+    if (n_runs > 1) {
+        sort_parallel(head, n, n_runs);
+    } else {
+        thread_compares = 0;
+        sort_list(head, n);
+        q_sort_compares += thread_compares;
+    }
+    if (is_array(head))
+        array_store_links(head);
 }
 
 /* Remove every node which has a node with a strictly greater value anywhere to
@@ -466,17 +1161,36 @@ __attribute__((nonnull(2, 3))) void list_sort(void *priv,
 int q_descend(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-nodes-from-linked-list/
-    if (head == NULL || list_empty(head))
+    if (head == NULL || !q_size(head))
         return 0;
+    if (is_array(head)) {
+        /* Survivors are compacted towards the tail */
+        deque_t *d = &to_queue(head)->deque;
+        size_t kept = d->count - 1;
+        element_t *max = *deque_at(d, kept);
+        for (size_t i = kept; i-- > 0;) {
+            element_t *e = *deque_at(d, i);
+            if (element_cmp(max, e) < 0) {
+                *deque_at(d, --kept) = e;
+                max = e;
+            } else {
+                q_release_element(e);
+            }
+        }
+        deque_drop_head(d, kept);
+        to_queue(head)->size = d->count;
+        return q_size(head);
+    }
     element_t *first = list_entry(head->prev, element_t, list);
     element_t *second = list_entry(head->prev->prev, element_t, list);
     while (&second->list != head) {
-        if (strcmp(first->value, second->value) < 0) {
+        if (element_cmp(first, second) < 0) {
             second = list_entry(second->list.prev, element_t, list);
             first = list_entry(first->list.prev, element_t, list);
         } else {
             list_del(&second->list);
             q_release_element(second);
+            to_queue(head)->size--;
             second = list_entry(first->list.prev, element_t, list);
         }
     }
@@ -492,40 +1206,191 @@ int merge_two_list(struct list_head *first, struct list_head *second)
     while (!list_empty(first) && !list_empty(second)) {
         element_t *first_front = list_first_entry(first, element_t, list);
         element_t *second_front = list_first_entry(second, element_t, list);
-        char *first_str = first_front->value, *second_str = second_front->value;
-        element_t *minimum =
-            strcmp(first_str, second_str) < 0 ? first_front : second_front;
+        element_t *minimum = element_cmp(first_front, second_front) < 0
+                                 ? first_front
+                                 : second_front;
         list_move_tail(&minimum->list, &temp_head);
     }
     list_splice_tail_init(first, &temp_head);
     list_splice_tail_init(second, &temp_head);
     list_splice(&temp_head, first);
+    to_queue(first)->size += to_queue(second)->size;
+    to_queue(second)->size = 0;
     return q_size(first);
 }
 
-/* Merge all the queues into one sorted queue, which is in ascending order */
-int q_merge(struct list_head *head)
+int merge_alg = MERGE_PAIRWISE;
+
+/* Queues merged in one pass of the k-way merge. q_merge() must not allocate,
+ * so the heap lives on the stack and longer chains are merged in batches.
+ */
+#define MERGE_FANIN 64
+
+/* A queue taking part in the k-way merge */
+typedef struct {
+    struct list_head *q;
+    int order; /* Position in the chain, breaks ties to keep merge stable */
+} merge_src_t;
+
+/* Whether the front of queue a goes before the front of queue b */
+static inline bool merge_src_less(const merge_src_t *a, const merge_src_t *b)
 {
-    // https://leetcode.com/problems/merge-k-sorted-lists/
-    if (!head || list_empty(head))
-        return 0;
-    else if (list_is_singular(head))
-        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
-    int size = q_size(head);
+    int cmp = sort_cmp(list_first_entry(a->q, element_t, list),
+                       list_first_entry(b->q, element_t, list));
+    return cmp < 0 || (cmp == 0 && a->order < b->order);
+}
+
+/* Restore the min-heap property of the n queues in heap below index i */
+static void merge_sift_down(merge_src_t *heap, int n, int i)
+{
+    merge_src_t src = heap[i];
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && merge_src_less(&heap[c + 1], &heap[c]))
+            c++;
+        if (!merge_src_less(&heap[c], &src))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = src;
+}
+
+/* Move every element of the n non-empty queues in heap to the tail of result
+ * in ascending order
+ */
+static void merge_heap(merge_src_t *heap, int n, struct list_head *result)
+{
+    for (int i = n / 2 - 1; i >= 0; i--)
+        merge_sift_down(heap, n, i);
+    while (n > 0) {
+        list_move_tail(heap[0].q->next, result);
+        if (list_empty(heap[0].q))
+            heap[0] = heap[--n];
+        merge_sift_down(heap, n, 0);
+    }
+}
+
+/* Merge the sorted runs into the empty list result. Runs hold consecutive
+ * parts of the original list, so ties going to the earlier run keep the sort
+ * stable.
+ */
+static void merge_runs(sort_run_t *runs, int n_runs, struct list_head *result)
+{
+    merge_src_t heap[TPOOL_MAX_WORKERS + 1];
+    for (int i = 0; i < n_runs; i++)
+        heap[i] = (merge_src_t){&runs[i].head, i};
+    merge_heap(heap, n_runs, result);
+}
+
+/* Merge all queues into the first one with a min-heap over their fronts,
+ * doing O(N log k) comparisons for N elements in k queues
+ */
+static int merge_kway(struct list_head *head)
+{
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    struct list_head *pos = first->chain.next;
+    int total = q_size(first->q);
+
+    while (pos != head) {
+        merge_src_t heap[MERGE_FANIN];
+        int n = 0, order = 0;
+        LIST_HEAD(result);
+
+        if (!list_empty(first->q))
+            heap[n++] = (merge_src_t){first->q, order};
+        for (; pos != head && n < MERGE_FANIN; pos = pos->next) {
+            struct list_head *q = list_entry(pos, queue_contex_t, chain)->q;
+            order++;
+            if (!q || list_empty(q))
+                continue;
+            total += q_size(q);
+            to_queue(q)->size = 0;
+            heap[n++] = (merge_src_t){q, order};
+        }
+        merge_heap(heap, n, &result);
+        list_splice(&result, first->q);
+    }
+
+    to_queue(first->q)->size = total;
+    return total;
+}
+
+/* Merge the queues of the chain at head by their list links */
+static int merge_lists(struct list_head *head)
+{
+    if (merge_alg == MERGE_HEAP)
+        return merge_kway(head);
+    int size = 0;
+    struct list_head *l;
+    list_for_each (l, head)
+        size++;
     int count = (size % 2) ? size / 2 + 1 : size / 2;
-    int queue_size = 0;
     for (int i = 0; i < count; ++i) {
         queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
         queue_contex_t *second =
             list_entry(first->chain.next, queue_contex_t, chain);
         while (!list_empty(first->q) && !list_empty(second->q)) {
-            queue_size = merge_two_list(first->q, second->q);
+            merge_two_list(first->q, second->q);
             list_move_tail(&second->chain, head);
             first = list_entry(first->chain.next, queue_contex_t, chain);
             second = list_entry(first->chain.next, queue_contex_t, chain);
         }
     }
-    return queue_size;
+    return q_size(list_first_entry(head, queue_contex_t, chain)->q);
+}
+
+/* Refill the arrays of the merged chain at head from the list links without
+ * allocating. The first queue, the only one left with elements, takes over
+ * the largest array in the chain. Should even that be too small, the queue
+ * stays linked for good and keeps the array until q_free().
+ */
+static void array_reload(struct list_head *head)
+{
+    queue_head_t *first =
+        to_queue(list_first_entry(head, queue_contex_t, chain)->q);
+    bool refill = first->layout == LAYOUT_ARRAY;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, head, chain) {
+        if (!ctx->q || !is_array(ctx->q))
+            continue;
+        deque_t *d = &to_queue(ctx->q)->deque;
+        deque_drop_tail(d, d->count);
+        if (refill && deque_capacity(d) > deque_capacity(&first->deque)) {
+            deque_t tmp = *d;
+            *d = first->deque;
+            first->deque = tmp;
+        }
+    }
+    if (!refill)
+        return;
+    if (deque_capacity(&first->deque) < (size_t) first->size) {
+        first->layout = LAYOUT_LIST;
+        return;
+    }
+    element_t *e;
+    list_for_each_entry (e, &first->head, list)
+        deque_push_tail(&first->deque, e);
+}
+
+/* Merge all the queues into one sorted queue, which is in ascending order */
+int q_merge(struct list_head *head)
+{
+    // https://leetcode.com/problems/merge-k-sorted-lists/
+    if (!head || list_empty(head))
+        return 0;
+    else if (list_is_singular(head))
+        return q_size(list_first_entry(head, queue_contex_t, chain)->q);
+
+    /* Array-backed queues take part through their list links */
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, head, chain)
+        q_links(ctx->q);
+    int size = merge_lists(head);
+    array_reload(head);
+    return size;
 }
 
 static inline void swap(struct list_head *node_1, struct list_head *node_2)
@@ -541,8 +1406,21 @@ static inline void swap(struct list_head *node_1, struct list_head *node_2)
 
 void q_shuffle(struct list_head *head)
 {
-    if (!head || list_is_singular(head))
+    if (!head || q_size(head) <= 1)
+        return;
+    if (is_array(head)) {
+        /* Same draws and swaps as the list version below */
+        deque_t *d = &to_queue(head)->deque;
+        for (size_t size = d->count; size > 0; size--) {
+            size_t index = rand() % size;
+            void **new = deque_at(d, size - 1);
+            void **old = deque_at(d, size - 1 - index);
+            void *tmp = *new;
+            *new = *old;
+            *old = tmp;
+        }
         return;
+    }
     struct list_head *last = head;
     int size = q_size(head);
     while (size > 0) {
@@ -9,22 +9,92 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
+#include "deque.h"
 #include "harness.h"
 #include "list.h"
+#include "pool.h"
 
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
+ * @pool: pool the element was carved from, NULL if allocated with malloc
+ * @key: first 8 bytes of @value packed big-endian and zero padded, so that
+ *       comparing keys orders elements like comparing their strings
+ * @len: length of @value, set once when the element is created
+ * @flags: ELEMENT_INLINE if @value is stored right after the element
  *
- * @value needs to be explicitly allocated and freed
+ * @value needs to be explicitly allocated and freed. Strings of up to
+ * ELEMENT_INLINE_LEN bytes are stored inline, right after the element
+ * itself, and share its allocation. Elements start on a cache line, so the
+ * links, the key and the first bytes of an inline string share it, and the
+ * rest of the string follows on the next line.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    pool_t *pool;
+    uint64_t key;
+    uint32_t len;
+    uint32_t flags;
 } element_t;
 
+/* Longest string stored inline */
+#define ELEMENT_INLINE_LEN 40
+
+/* Alignment of elements, one cache line */
+#define ELEMENT_ALIGN 64
+
+/* Flags of elements */
+#define ELEMENT_INLINE 1
+
+/* Is the string of e stored right after e itself? */
+static inline bool q_value_inline(const element_t *e)
+{
+    return e->flags & ELEMENT_INLINE;
+}
+
+/* First bytes of s packed big-endian, so that keys order like strings */
+static inline uint64_t q_prefix_key(const char *s)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < 8 && s[i]; i++)
+        key |= (uint64_t) (unsigned char) s[i] << (56 - 8 * i);
+    return key;
+}
+
+/* Layouts of queues */
+typedef enum { LAYOUT_LIST, LAYOUT_ARRAY, N_LAYOUT } queue_layout_t;
+
+/* Layout of newly created queues */
+extern int queue_layout;
+
+/**
+ * queue_head_t - Head of a queue
+ * @head: list head linking the elements of the queue
+ * @size: number of elements currently in the queue
+ * @pool: pool backing new elements, NULL if they are allocated with malloc
+ * @layout: LAYOUT_LIST or LAYOUT_ARRAY, fixed when the queue is created
+ * @deque: elements of an array-backed queue in order, unused otherwise
+ *
+ * q_new() hands out a pointer to @head, so every queue operation still takes a
+ * plain struct list_head. @size is maintained by each operation in queue.c
+ * that links or unlinks elements, which makes q_size() constant time.
+ *
+ * Array-backed queues keep their elements in @deque only. Their list links,
+ * including those of @head, are rebuilt by q_links() on demand and go stale
+ * with the next operation.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    pool_t *pool;
+    int layout;
+    deque_t deque;
+} queue_head_t;
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -44,6 +114,10 @@ typedef struct {
 /**
  * q_new() - Create an empty queue whose next and prev pointer point to itself
  *
+ * Elements of the queue are allocated by the backend selected through
+ * alloc_backend at the time the queue is created, and kept in the layout
+ * selected through queue_layout.
+ *
  * Return: NULL for allocation failed
  */
 struct list_head *q_new();
@@ -78,6 +152,35 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_bulk() - Insert n elements in the head
+ * @head: header of queue
+ * @sv: array of the n strings would be inserted
+ * @n: number of strings
+ *
+ * Equivalent to calling q_insert_head() on sv[0], ..., sv[n - 1] in turn,
+ * so sv[n - 1] ends up first. All elements are allocated and linked into a
+ * private list before it is spliced onto the queue in one step.
+ *
+ * Return: true for success, false for allocation failed or queue is NULL.
+ * The queue is left unchanged on failure.
+ */
+bool q_insert_head_bulk(struct list_head *head, char **sv, int n);
+
+/**
+ * q_insert_tail_bulk() - Insert n elements at the tail
+ * @head: header of queue
+ * @sv: array of the n strings would be inserted
+ * @n: number of strings
+ *
+ * Equivalent to calling q_insert_tail() on sv[0], ..., sv[n - 1] in turn,
+ * with the same all-or-nothing behavior as q_insert_head_bulk().
+ *
+ * Return: true for success, false for allocation failed or queue is NULL.
+ * The queue is left unchanged on failure.
+ */
+bool q_insert_tail_bulk(struct list_head *head, char **sv, int n);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -108,6 +211,66 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_remove_head_n() - Remove up to n elements from head of queue and free them
+ * @head: header of queue
+ * @n: number of elements to remove
+ * @buf: buffer receiving the removed strings, may be NULL
+ * @bufsize: size of the buffer
+ * @copied: set to the number of strings copied into buf, may be NULL
+ *
+ * The first n elements, or all of them if the queue is shorter, are cut off
+ * in one step and released. If buf is non-NULL, their strings are copied
+ * into it back to back in removal order, each with its null terminator.
+ * Copying stops at the first string that does not fit in the remaining
+ * space, so only the first *copied strings in buf are valid.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_head_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    int *copied);
+
+/**
+ * q_remove_tail_n() - Remove up to n elements from tail of queue and free them
+ * @head: header of queue
+ * @n: number of elements to remove
+ * @buf: buffer receiving the removed strings, may be NULL
+ * @bufsize: size of the buffer
+ * @copied: set to the number of strings copied into buf, may be NULL
+ *
+ * Like q_remove_head_n(), with the strings stored starting from the last
+ * element of the queue.
+ *
+ * Return: the number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_tail_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    int *copied);
+
+/**
+ * q_new_element() - Allocate an element holding a copy of the string
+ * @pool: pool to carve the element from, NULL to allocate it with malloc
+ * @s: string to copy
+ *
+ * This function is intended for internal use only.
+ *
+ * Return: the element, NULL if allocation failed
+ */
+element_t *q_new_element(pool_t *pool, const char *s);
+
+/**
+ * q_release_pooled() - Return the element to the pool it was carved from
+ * @e: element would be released
+ *
+ * This function is intended for internal use only.
+ */
+void q_release_pooled(element_t *e);
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
@@ -116,14 +279,44 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
+    if (e->pool) {
+        q_release_pooled(e);
+        return;
+    }
+    if (!q_value_inline(e))
+        test_free(e->value);
     test_free(e);
 }
 
+/**
+ * q_links() - Link the elements of the queue in order
+ * @head: header of queue
+ *
+ * Array-backed queues do not maintain list links, so code walking a queue
+ * with the macros of list.h calls this first. The links stay valid until the
+ * next operation on the queue. No effect on linked queues.
+ */
+void q_links(struct list_head *head);
+
+/**
+ * q_peek() - Look at an element near either end of the queue
+ * @head: header of queue
+ * @at_tail: count from the tail instead of the head
+ * @i: number of elements to skip
+ *
+ * Constant time for array-backed queues, O(@i) for linked ones.
+ *
+ * Return: the element, NULL if the queue holds no more than @i elements
+ */
+element_t *q_peek(struct list_head *head, bool at_tail, int i);
+
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * The count cached in queue_head_t is returned without walking the list.
+ * Building with QUEUE_DEBUG defined cross-checks it against a full walk.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -190,10 +383,33 @@ void q_reverse(struct list_head *head);
  */
 void q_reverseK(struct list_head *head, int k);
 
+/* Sorting engines behind q_sort() */
+typedef enum { SORT_MERGE, SORT_LISTSORT, SORT_RADIX, N_SORT } sort_alg_t;
+
+/* Engine used by q_sort() */
+extern int sort_alg;
+
+/* Number of threads q_sort() may use, including the calling one */
+extern int sort_threads;
+
+/* Number of string comparisons performed by q_sort() so far */
+extern size_t q_sort_compares;
+
+/* Whether element comparisons consult the prefix keys before the strings */
+extern int key_prefix;
+
 /**
  * q_sort() - Sort elements of queue in ascending order
  * @head: header of queue
  *
+ * The list is sorted by the engine selected through sort_alg: the recursive
+ * top-down merge sort, the port of the Linux kernel's bottom-up list_sort,
+ * or an MSD radix sort that buckets elements by byte. With sort_threads
+ * above one, long queues are cut into one run per thread, the runs are
+ * sorted concurrently and then merged back in a stable way. Array-backed
+ * queues are sorted the same way through their list links, and their array
+ * is then rewritten in place.
+ *
  * No effect if queue is NULL or empty. If there has only one element, do
  * nothing.
  */
@@ -214,6 +430,12 @@ void q_sort(struct list_head *head);
  */
 int q_descend(struct list_head *head);
 
+/* Strategies behind q_merge() */
+typedef enum { MERGE_PAIRWISE, MERGE_HEAP, N_MERGE } merge_alg_t;
+
+/* Strategy used by q_merge() */
+extern int merge_alg;
+
 /**
  * q_merge() - Merge all the queues into one sorted queue, which is in ascending
  * order.
@@ -226,6 +448,11 @@ int q_descend(struct list_head *head);
  * 'q' since they will be released externally. However, q_merge() is responsible
  * for making the queues to be NULL-queue, except the first one.
  *
+ * merge_alg selects between merging queues two at a time and a k-way merge
+ * driven by a min-heap over the fronts of all queues. Array-backed queues are
+ * merged through their list links. The first queue then refills the largest
+ * array of the chain, and stays linked should that array be too small.
+ *
  * Reference:
  * https://leetcode.com/problems/merge-k-sorted-lists/
  *
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import os
+import subprocess
+import sys
+import getopt
+import tempfile
+import time
+
+# Replays a synthetic script through qtest to measure the cost of reading,
+# parsing and dispatching command lines. The commands are cheap on purpose,
+# so the time per line is dominated by the console itself.
+
+# Mix of built-in and qtest commands, and of names early and late in the
+# alphabet, run against an empty queue
+script_lines = [
+    "option verbose 0",
+    "size",
+    "option echo 0",
+    "option fail 30",
+    "option error 5",
+    "next",
+    "option simulation 0",
+    "prev",
+]
+
+
+def usage(name):
+    print("Usage: %s [-h] [-n LINES] [-q QTEST]" % name)
+    print("  -h        Print this message")
+    print("  -n LINES  Number of lines to replay (default: 10000000)")
+    print("  -q QTEST  qtest binary to run (default: ./qtest)")
+    sys.exit(0)
+
+
+def write_script(f, lines):
+    f.write("new\n")
+    chunk = "\n".join(script_lines) + "\n"
+    for _ in range(lines // len(script_lines)):
+        f.write(chunk)
+    for line in script_lines[:lines % len(script_lines)]:
+        f.write(line + "\n")
+    f.write("free\n")
+
+
+def run(name, args):
+    lines = 10000000
+    qtest = "./qtest"
+
+    optlist, args = getopt.getopt(args, 'hn:q:')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-n':
+            lines = int(val)
+        elif opt == '-q':
+            qtest = val
+
+    fd, path = tempfile.mkstemp(suffix=".cmd")
+    try:
+        with os.fdopen(fd, "w") as f:
+            write_script(f, lines)
+        start = time.time()
+        with open(os.devnull, "w") as devnull:
+            retcode = subprocess.call([qtest, "-v", "0", "-f", path],
+                                      stdout=devnull)
+        elapsed = time.time() - start
+    finally:
+        os.remove(path)
+
+    if retcode != 0:
+        print("%s exited with status %d" % (qtest, retcode))
+        sys.exit(1)
+    print("%d lines in %.3f sec, %.0f ns/line" %
+          (lines, elapsed, elapsed * 1e9 / lines))
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
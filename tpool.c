@@ -0,0 +1,178 @@
+/* Fixed pool of worker threads running fork-join jobs */
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "tpool.h"
+
+static pthread_t workers[TPOOL_MAX_WORKERS];
+static int n_workers = 0;
+
+/* Current job, protected by lock */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static unsigned long generation = 0; /* Bumped whenever a job is posted */
+static tpool_task_t job_task;
+static void *job_arg;
+static int job_next;    /* Next index to hand out */
+static int job_n;       /* Number of indices in the job */
+static int job_pending; /* Indices handed out but not finished yet */
+static int stop_below = TPOOL_MAX_WORKERS; /* Workers at or above exit */
+static bool caller_busy; /* The calling thread is running an index */
+
+/* How long the caller waits for workers before taking pending signals */
+#define TPOOL_WAIT_NSEC (10 * 1000 * 1000)
+
+/* Take lock with every signal blocked, so that a handler jumping away never
+ * leaves it held, and store the previous mask at saved
+ */
+static void lock_masked(sigset_t *saved)
+{
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, saved);
+    pthread_mutex_lock(&lock);
+}
+
+static void unlock_masked(const sigset_t *saved)
+{
+    pthread_mutex_unlock(&lock);
+    pthread_sigmask(SIG_SETMASK, saved, NULL);
+}
+
+/* Run indices of the current job until none are left. Called with lock held.
+ * The calling thread passes the mask to run its indices with at saved,
+ * workers pass NULL.
+ */
+static void run_tasks(const sigset_t *saved)
+{
+    while (job_next < job_n) {
+        int idx = job_next++;
+        job_pending++;
+        if (saved) {
+            caller_busy = true;
+            unlock_masked(saved);
+            job_task(job_arg, idx);
+            sigset_t ignored;
+            lock_masked(&ignored);
+            caller_busy = false;
+        } else {
+            pthread_mutex_unlock(&lock);
+            job_task(job_arg, idx);
+            pthread_mutex_lock(&lock);
+        }
+        if (--job_pending == 0 && job_next == job_n)
+            pthread_cond_broadcast(&job_done);
+    }
+}
+
+static void *worker(void *arg)
+{
+    int id = (int) (long) arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&lock);
+    seen = generation;
+    for (;;) {
+        while (generation == seen && id < stop_below)
+            pthread_cond_wait(&job_ready, &lock);
+        if (id >= stop_below)
+            break;
+        seen = generation;
+        run_tasks(NULL);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void tpool_wait()
+{
+    sigset_t saved;
+    lock_masked(&saved);
+    /* A handler jumped away while the caller ran an index. Its arguments
+     * may be gone, so hand out no more indices.
+     */
+    if (caller_busy) {
+        caller_busy = false;
+        job_n = job_next;
+        if (--job_pending == 0)
+            pthread_cond_broadcast(&job_done);
+    }
+    while (job_pending > 0 || job_next < job_n) {
+        /* Let signals in now and then, so that the time limit still holds
+         * while a worker runs long
+         */
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += TPOOL_WAIT_NSEC;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&job_done, &lock, &until);
+        unlock_masked(&saved);
+        lock_masked(&saved);
+    }
+    unlock_masked(&saved);
+}
+
+bool tpool_resize(int n)
+{
+    tpool_wait();
+    if (n < 0)
+        n = 0;
+    if (n > TPOOL_MAX_WORKERS)
+        n = TPOOL_MAX_WORKERS;
+
+    if (n < n_workers) {
+        pthread_mutex_lock(&lock);
+        stop_below = n;
+        pthread_cond_broadcast(&job_ready);
+        pthread_mutex_unlock(&lock);
+        for (int i = n; i < n_workers; i++)
+            pthread_join(workers[i], NULL);
+        n_workers = n;
+    }
+
+    /* New workers inherit a mask blocking every signal */
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_mutex_lock(&lock);
+    stop_below = TPOOL_MAX_WORKERS;
+    pthread_mutex_unlock(&lock);
+    bool ok = true;
+    while (n_workers < n) {
+        if (pthread_create(&workers[n_workers], NULL, worker,
+                           (void *) (long) n_workers) != 0) {
+            ok = false;
+            break;
+        }
+        n_workers++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return ok;
+}
+
+void tpool_run(tpool_task_t task, void *arg, int n)
+{
+    /* A job left behind by a handler jumping away finishes first */
+    tpool_wait();
+
+    sigset_t saved;
+    lock_masked(&saved);
+    job_task = task;
+    job_arg = arg;
+    job_next = 0;
+    job_n = n;
+    job_pending = 0;
+    generation++;
+    pthread_cond_broadcast(&job_ready);
+
+    /* The caller works on the job too, then waits for the stragglers */
+    run_tasks(&saved);
+    unlock_masked(&saved);
+    tpool_wait();
+}
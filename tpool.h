@@ -0,0 +1,37 @@
+#ifndef LAB0_TPOOL_H
+#define LAB0_TPOOL_H
+
+/* Fixed pool of worker threads running fork-join jobs.
+ *
+ * Workers are created ahead of time, so running a job neither creates
+ * threads nor allocates memory. Workers block all signals, which keeps
+ * SIGALRM and friends on the main thread where the harness expects them.
+ * The main thread takes signals while it runs a job, so the time limit of
+ * the harness still applies, but never while it holds the pool's lock.
+ */
+
+#include <stdbool.h>
+
+/* Upper bound on the number of workers */
+#define TPOOL_MAX_WORKERS 63
+
+/* Task of a job, called once for every index in [0, n) */
+typedef void (*tpool_task_t)(void *arg, int idx);
+
+/* Start or stop workers so that exactly n of them exist.
+ * Return false if a worker could not be started.
+ */
+bool tpool_resize(int n);
+
+/* Run task for every index in [0, n) on the workers and the calling thread,
+ * and wait until all of them have finished.
+ */
+void tpool_run(tpool_task_t task, void *arg, int n);
+
+/* Wait until the workers are done with the last job.  A signal handler
+ * jumping out of tpool_run() leaves them running, and whatever they work on
+ * must not be touched before this returns.
+ */
+void tpool_wait();
+
+#endif /* LAB0_TPOOL_H */
@@ -0,0 +1,211 @@
+/* Reading and writing binary command traces */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "report.h"
+#include "trace.h"
+
+/* Initial sizes of the tables, which double when full */
+#define MIN_WORDS 64
+#define MIN_ARGS 8
+
+bool trace_is_binary(const char *buf, size_t len)
+{
+    return len >= TRACE_MAGIC_LEN &&
+           memcmp(buf, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0;
+}
+
+bool trace_reader_init(trace_reader_t *r, char *buf, size_t len)
+{
+    if (!trace_is_binary(buf, len))
+        return false;
+
+    r->pos = buf + TRACE_MAGIC_LEN;
+    r->end = buf + len;
+    r->n_words = 0;
+    r->max_words = MIN_WORDS;
+    r->words = calloc_or_fail(r->max_words, sizeof(char *), "trace_reader");
+    r->max_args = MIN_ARGS;
+    r->argv = calloc_or_fail(r->max_args, sizeof(char *), "trace_reader");
+    return true;
+}
+
+/* Replace array, holding n pointers, with one twice as large */
+static char **grow(char **array, size_t n)
+{
+    char **bigger = calloc_or_fail(2 * n, sizeof(char *), "trace_grow");
+    memcpy(bigger, array, n * sizeof(char *));
+    free_array(array, n, sizeof(char *));
+    return bigger;
+}
+
+/* Read unsigned LEB128 value.  Return false if it runs off the end */
+static bool get_varint(trace_reader_t *r, size_t *vp)
+{
+    size_t v = 0;
+    for (int shift = 0; shift < 64 && r->pos < r->end; shift += 7) {
+        unsigned char b = *r->pos++;
+        v |= (size_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *vp = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Read a word, adding it to the string table if new */
+static char *get_word(trace_reader_t *r)
+{
+    size_t ref;
+    if (!get_varint(r, &ref))
+        return NULL;
+    if (ref > 0)
+        return ref <= r->n_words ? r->words[ref - 1] : NULL;
+
+    char *word = r->pos;
+    char *nul = memchr(word, '\0', r->end - word);
+    if (!nul)
+        return NULL;
+    r->pos = nul + 1;
+    if (r->n_words == r->max_words) {
+        r->words = grow(r->words, r->max_words);
+        r->max_words *= 2;
+    }
+    r->words[r->n_words++] = word;
+    return word;
+}
+
+int trace_next(trace_reader_t *r, char ***argvp)
+{
+    if (!trace_pending(r))
+        return TRACE_END;
+
+    size_t argc;
+    /* Every word takes at least one byte */
+    if (!get_varint(r, &argc) || argc > (size_t) (r->end - r->pos) ||
+        argc > INT_MAX)
+        return TRACE_BAD;
+    while (argc > (size_t) r->max_args) {
+        r->argv = grow(r->argv, r->max_args);
+        r->max_args *= 2;
+    }
+    for (size_t i = 0; i < argc; i++) {
+        r->argv[i] = get_word(r);
+        if (!r->argv[i])
+            return TRACE_BAD;
+    }
+
+    *argvp = r->argv;
+    return argc;
+}
+
+void trace_reader_destroy(trace_reader_t *r)
+{
+    free_array(r->words, r->max_words, sizeof(char *));
+    free_array(r->argv, r->max_args, sizeof(char *));
+    r->words = r->argv = NULL;
+}
+
+/* Words written so far, in an open-addressing table keyed by content */
+typedef struct {
+    char *word;
+    size_t ref; /* Position in the string table, counting from 1 */
+} word_slot_t;
+
+struct trace_writer {
+    FILE *file;
+    word_slot_t *slots;
+    size_t mask; /* Number of slots minus one */
+    size_t n_words;
+};
+
+/* FNV-1a hash of word */
+static size_t word_hash(const char *word)
+{
+    uint32_t h = 2166136261u;
+    while (*word)
+        h = (h ^ (unsigned char) *word++) * 16777619u;
+    return h;
+}
+
+/* Slot holding word, or the empty slot it would go in */
+static word_slot_t *word_slot(trace_writer_t *w, const char *word)
+{
+    size_t i = word_hash(word) & w->mask;
+    while (w->slots[i].word && strcmp(w->slots[i].word, word) != 0)
+        i = (i + 1) & w->mask;
+    return &w->slots[i];
+}
+
+/* Double the number of slots, keeping the table at most half full */
+static void rehash(trace_writer_t *w)
+{
+    word_slot_t *old = w->slots;
+    size_t n_old = w->mask + 1;
+    w->slots = calloc_or_fail(2 * n_old, sizeof(word_slot_t), "trace_rehash");
+    w->mask = 2 * n_old - 1;
+    for (size_t i = 0; i < n_old; i++)
+        if (old[i].word)
+            *word_slot(w, old[i].word) = old[i];
+    free_array(old, n_old, sizeof(word_slot_t));
+}
+
+static void put_varint(FILE *f, size_t v)
+{
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc(v, f);
+}
+
+trace_writer_t *trace_writer_open(const char *file)
+{
+    FILE *f = fopen(file, "wb");
+    if (!f)
+        return NULL;
+
+    trace_writer_t *w = malloc_or_fail(sizeof(trace_writer_t), "trace_writer");
+    w->file = f;
+    w->slots = calloc_or_fail(MIN_WORDS, sizeof(word_slot_t), "trace_writer");
+    w->mask = MIN_WORDS - 1;
+    w->n_words = 0;
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, f);
+    return w;
+}
+
+bool trace_write(trace_writer_t *w, int argc, char *argv[])
+{
+    put_varint(w->file, argc);
+    for (int i = 0; i < argc; i++) {
+        word_slot_t *slot = word_slot(w, argv[i]);
+        if (slot->word) {
+            put_varint(w->file, slot->ref);
+            continue;
+        }
+
+        put_varint(w->file, 0);
+        fwrite(argv[i], 1, strlen(argv[i]) + 1, w->file);
+        slot->word = strsave_or_fail(argv[i], "trace_write");
+        slot->ref = ++w->n_words;
+        if (2 * w->n_words > w->mask)
+            rehash(w);
+    }
+    return !ferror(w->file);
+}
+
+bool trace_writer_close(trace_writer_t *w)
+{
+    bool ok = !ferror(w->file);
+    ok = fclose(w->file) == 0 && ok;
+    for (size_t i = 0; i <= w->mask; i++)
+        if (w->slots[i].word)
+            free_string(w->slots[i].word);
+    free_array(w->slots, w->mask + 1, sizeof(word_slot_t));
+    free_block(w, sizeof(trace_writer_t));
+    return ok;
+}
@@ -0,0 +1,67 @@
+#ifndef LAB0_TRACE_H
+#define LAB0_TRACE_H
+
+/* Compact binary form of command scripts.
+ *
+ * A trace starts with TRACE_MAGIC and holds one record per command.  A
+ * record is the number of words as a varint, followed by each word.  A word
+ * is either a varint n > 0 naming the n-th distinct word seen so far, or 0
+ * followed by the bytes of a new word and a null terminator.  New words are
+ * thus added to the string table as they first appear, so a trace can be
+ * written while commands come in, and read back without any tokenizing.
+ * The first word of a record is the command name and acts as its opcode.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC "qtrace1\n"
+#define TRACE_MAGIC_LEN 8
+
+/* Returned by trace_next at the end of the trace, and on corrupt data */
+#define TRACE_END (-1)
+#define TRACE_BAD (-2)
+
+typedef struct {
+    char *pos; /* Next unread byte */
+    char *end;
+    char **words; /* String table, pointing into the trace itself */
+    size_t n_words, max_words;
+    char **argv;
+    int max_args;
+} trace_reader_t;
+
+/* Whether the len bytes at buf start like a trace */
+bool trace_is_binary(const char *buf, size_t len);
+
+/* Start reading the trace in buf, which must stay in place until
+ * trace_reader_destroy.  Return false if buf does not hold a trace.
+ */
+bool trace_reader_init(trace_reader_t *r, char *buf, size_t len);
+
+/* Whether records are left to read */
+static inline bool trace_pending(const trace_reader_t *r)
+{
+    return r->pos < r->end;
+}
+
+/* Read the next record, and point *argvp at its words.  Return the number
+ * of words, or TRACE_END or TRACE_BAD.  The words point into the trace and
+ * the array is reused by the next call.
+ */
+int trace_next(trace_reader_t *r, char ***argvp);
+
+void trace_reader_destroy(trace_reader_t *r);
+
+typedef struct trace_writer trace_writer_t;
+
+/* Create file and write the trace header.  Return NULL if that failed */
+trace_writer_t *trace_writer_open(const char *file);
+
+/* Append a record for one command.  Return false on write error */
+bool trace_write(trace_writer_t *w, int argc, char *argv[]);
+
+/* Flush and close the file, and free w.  Return false on write error */
+bool trace_writer_close(trace_writer_t *w);
+
+#endif /* LAB0_TRACE_H */
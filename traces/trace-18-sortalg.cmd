@@ -0,0 +1,76 @@
+# Test of sort with the radix and listsort engines, and of heap-based merge
+option fail 0
+option malloc 0
+option sortalg radix
+new
+ih gerbil
+ih ge
+ih bear
+it gerbils
+it dolphin
+it bear
+it g
+sort
+rh bear
+rh bear
+rh dolphin
+rh g
+rh ge
+rh gerbil
+rh gerbils
+free
+new
+ih RAND 1000
+sort
+free
+option sortalg listsort
+new
+ih meerkat
+ih bear
+it dolphin
+it bear
+ih zebra
+sort
+rh bear
+rh bear
+rh dolphin
+rh meerkat
+rh zebra
+free
+new
+ih RAND 1000
+sort
+free
+option sortalg merge
+option mergealg heap
+new
+ih a
+ih r
+ih b
+sort
+new
+ih m
+ih n
+ih a
+sort
+new
+ih r
+ih c
+ih z
+sort
+new
+it b
+it y
+merge
+rh a
+rh a
+rh b
+rh b
+rh c
+rh m
+rh n
+rh r
+rh r
+rh y
+rh z
+free
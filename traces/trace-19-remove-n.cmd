@@ -0,0 +1,32 @@
+# Test of batch removal with rhn and rtn
+option fail 0
+option malloc 0
+new
+ih dolphin
+ih bear
+ih gerbil
+it meerkat
+it zebra
+it vulture
+rhn 2
+rh dolphin
+rtn 2
+rt meerkat
+ih RAND 1000
+rhn 1000
+size 0
+# Removing more than the queue holds is tolerated below the fail limit
+option fail 10
+it gerbil
+it zebra
+rtn 5
+size 0
+option fail 0
+# Strings that do not fit in the buffer are still removed
+option length 4
+ih alligator
+ih crocodile
+ih gharial
+rhn 3
+size 0
+free
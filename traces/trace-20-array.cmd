@@ -0,0 +1,79 @@
+# Test of operations on array-backed queues
+option fail 0
+option malloc 0
+new array
+ih dolphin
+ih bear
+it gerbil
+it meerkat
+ih zebra
+it bear
+size 6
+reverse
+rh bear
+rt zebra
+it vulture
+ih alligator
+swap
+rh meerkat
+reverseK 2
+rh dolphin
+dm
+rt bear
+it bear
+it ant
+it bear
+sort
+rh alligator
+rh ant
+dedup
+rh gerbil
+size 0
+# Sorting with every engine and with threads
+ih RAND 20000
+option sortalg listsort
+sort
+option sortalg radix
+reverse
+sort
+option sortalg merge
+option threads 4
+reverse
+sort
+option threads 1
+descend
+size 1
+rhn 1
+ih RAND 1000
+rtn 1000
+size 0
+# Merging array-backed queues with a linked one
+it bear
+it gerbil
+it zebra
+new
+it dolphin
+it meerkat
+new array
+it ant
+it vulture
+merge
+rh ant
+rh bear
+rh dolphin
+rh gerbil
+rh meerkat
+rh vulture
+rh zebra
+free
+# Merging into more elements than any array holds
+new array
+ih RAND 20
+sort
+new array
+ih RAND 10
+sort
+merge
+size 30
+sort
+free
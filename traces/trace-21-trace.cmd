@@ -0,0 +1,22 @@
+# Test of compiling, recording and replaying binary traces
+option fail 0
+option malloc 0
+trace compile traces/trace-01-ops.cmd /tmp/qtest-trace-21-ops.qtb
+source /tmp/qtest-trace-21-ops.qtb
+size 0
+free
+trace record /tmp/qtest-trace-21-record.qtb
+new
+ih gerbil
+ih bear
+it dolphin
+ih RAND 100
+rhn 100
+trace stop
+free
+source /tmp/qtest-trace-21-record.qtb
+rh bear
+rh gerbil
+rh dolphin
+size 0
+free